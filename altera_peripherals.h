@@ -105,6 +105,7 @@ typedef struct _altera_uart {
 typedef struct _altera_fifo_csr {
     uint32_t fill_level;
     uint32_t i_status;
+    uint32_t event;
     uint32_t interuptenable;
     uint32_t almostfull;
     uint32_t almostempty;
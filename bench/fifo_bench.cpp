@@ -0,0 +1,325 @@
+//=================================================================================================
+// fifo_bench.cpp - Measures how fast CFpgaFifo moves words thru a simulated FIFO.
+//
+// Build and run it with "make bench".  There's no FPGA on an x86 box, so the FIFOs are the
+// emulated ones from emu_fifo.h, living in an emulated register window.
+//=================================================================================================
+#include <stdio.h>
+#include <string.h>
+#include "memmap.h"
+#include "fpga_fifo.h"
+#include "emu_fifo.h"
+#include "sopcinfo.h"
+#include "hrclock.h"
+#include "fifo_pack.h"
+
+
+//=================================================================================================
+// Every measurement moves about this many 32-bit words, so each one runs for a good fraction of
+// a second
+//=================================================================================================
+#define BENCH_WORDS     (16 * 1024 * 1024)
+//=================================================================================================
+
+
+//=================================================================================================
+// The message sizes we measure, in 32-bit words.  The largest is a full GXIP packet
+//=================================================================================================
+static const int msg_words[] = {1, 4, 16, 64, 256, (sizeof(gxip_packet_t) + 3) / 4};
+#define MSG_SIZES  (int)(sizeof(msg_words) / sizeof(msg_words[0]))
+//=================================================================================================
+
+
+//=================================================================================================
+// The message sizes we pack, in bytes.  The largest is a full GXIP packet.  These are the sizes
+// of the messages themselves, so most aren't a whole number of words
+//=================================================================================================
+static const int pack_bytes[] = {16, 67, 259, 1027, sizeof(gxip_packet_t)};
+#define PACK_SIZES  (int)(sizeof(pack_bytes) / sizeof(pack_bytes[0]))
+//=================================================================================================
+
+
+//=================================================================================================
+// A simulated FIFO data port and fill-level register.  They're volatile, so every access is a
+// real load, the way it is for the hardware registers
+//=================================================================================================
+static volatile u32 sim_data  = 0x12345678;
+static volatile u32 sim_level = 256;
+//=================================================================================================
+
+
+//=================================================================================================
+// read_words_before() - Reads "count" words from the simulated port the way read_message() did
+//                       before burst reads: one word per loop, checking a countdown of the last
+//                       fill level we read
+//=================================================================================================
+static void read_words_before(u32* out, int count)
+{
+    int words_in_pipe = 0;
+
+    while (count--)
+    {
+        while (words_in_pipe == 0) words_in_pipe = sim_level;
+        *out++ = sim_data;
+        --words_in_pipe;
+    }
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// read_words_after() - Reads "count" words from the simulated port the way read_burst() does:
+//                      one fill-level snapshot per burst, then four words per loop
+//=================================================================================================
+static void read_words_after(u32* out, int count)
+{
+    while (count)
+    {
+        // Take a snapshot of the fill level, and don't read past the end of the message
+        int burst = sim_level;
+        if (burst > count) burst = count;
+        count -= burst;
+
+        // Read the words four at a time, and then the leftovers one at a time
+        for (; burst >= 4; burst -= 4, out += 4)
+        {
+            out[0] = sim_data;
+            out[1] = sim_data;
+            out[2] = sim_data;
+            out[3] = sim_data;
+        }
+        while (burst--) *out++ = sim_data;
+    }
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// read_message_before() - Reads one message from an emulated FIFO the way read_message() did
+//                         before burst reads, with no deadline and no slots
+//=================================================================================================
+static void read_message_before(emu_fifo_t* fifo, u32* out)
+{
+    fifo->pop();
+    int length = fifo->pop();
+    int words_in_pipe = 0;
+
+    while (length--)
+    {
+        while (words_in_pipe == 0) words_in_pipe = fifo->level();
+        *out++ = fifo->pop();
+        --words_in_pipe;
+    }
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// push_message() - Writes a GXIP message of "words" 32-bit words into an emulated FIFO, the way
+//                  the firmware model does
+//=================================================================================================
+static void push_message(emu_fifo_t* fifo, int words)
+{
+    fifo->push(FIFO_MSG_GXIP);
+    fifo->push(words);
+    for (int i=0; i<words; ++i) fifo->push(i);
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// mwords_per_sec() - Converts a count of words and a duration to millions of words per second
+//=================================================================================================
+static double mwords_per_sec(u64 words, u64 usec)
+{
+    return usec ? (double)words / usec : 0;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// bench_read() - Measures reading messages from the F2H FIFO, before and after burst reads
+//=================================================================================================
+static void bench_read(CFpgaFifo& fifo, emu_fifo_t* f2h)
+{
+    static u32 payload[(sizeof(gxip_packet_t) + 3) / 4];
+    u64 start;
+
+    // First, just the loop that reads the words from the data port
+    printf("\nF2H read loop, simulated data port (Mwords/sec)\n");
+    printf("   words     before      after\n");
+    for (int i=0; i<MSG_SIZES; ++i)
+    {
+        int words = msg_words[i];
+        int loops = BENCH_WORDS / words;
+
+        start = hrclock_usec();
+        for (int n=0; n<loops; ++n) read_words_before(payload, words);
+        u64 before = hrclock_usec() - start;
+
+        start = hrclock_usec();
+        for (int n=0; n<loops; ++n) read_words_after(payload, words);
+        u64 after = hrclock_usec() - start;
+
+        printf("%8i %10.1f %10.1f\n", words, mwords_per_sec((u64)loops * words, before),
+                                             mwords_per_sec((u64)loops * words, after));
+    }
+
+    // Then entire messages, header and all, thru the emulated FIFO.  Writing each message into
+    // the FIFO is part of what's timed, the same for both
+    printf("\nF2H messages, emulated FIFO, including the writes (Mwords/sec)\n");
+    printf("   words     before      after\n");
+    for (int i=0; i<MSG_SIZES; ++i)
+    {
+        int words = msg_words[i];
+        int loops = BENCH_WORDS / (words + 2);
+
+        start = hrclock_usec();
+        for (int n=0; n<loops; ++n)
+        {
+            push_message(f2h, words);
+            read_message_before(f2h, payload);
+        }
+        u64 before = hrclock_usec() - start;
+
+        start = hrclock_usec();
+        for (int n=0; n<loops; ++n)
+        {
+            push_message(f2h, words);
+            fifo.release(fifo.read_message(0));
+        }
+        u64 after = hrclock_usec() - start;
+
+        printf("%8i %10.1f %10.1f\n", words, mwords_per_sec((u64)loops * (words + 2), before),
+                                             mwords_per_sec((u64)loops * (words + 2), after));
+    }
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// pack_words_before() - Packs bytes into 32-bit words the way send_generic() did before
+//                       pack_words(): four shifts and ORs per word
+//=================================================================================================
+static void pack_words_before(const unsigned char* src, uint32_t* dst, int count)
+{
+    uint32_t word = 0;
+
+    while (count--)
+    {
+        word >>= 8; word |= (*src++ << 24);
+        word >>= 8; word |= (*src++ << 24);
+        word >>= 8; word |= (*src++ << 24);
+        word >>= 8; word |= (*src++ << 24);
+        *dst++ = word;
+    }
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// bench_pack() - Measures packing a message that isn't on a 32-bit boundary into words, and
+//                writing messages to the H2F FIFO from aligned and unaligned buffers
+//=================================================================================================
+static void bench_pack(CFpgaFifo& fifo, emu_fifo_t* h2f)
+{
+    alignas(16) static u8       buffer[sizeof(gxip_packet_t) + 16];
+    alignas(16) static uint32_t words[(sizeof(gxip_packet_t) + 3) / 4 + 4];
+    volatile uint32_t sink;
+    fifo_tx_t tx;
+    u64 start;
+
+    // Give the message bytes something other than zeros
+    for (int i=0; i<(int)sizeof(buffer); ++i) buffer[i] = i;
+
+    // A message that starts one byte past a 32-bit boundary
+    const unsigned char* src = buffer + 1;
+
+    // First, just the packing, with the old shifts and ORs, the scalar path that's used when
+    // there's no vector unit, and the vector path
+    printf("\nH2F packing, unaligned source (Mwords/sec)\n");
+    printf("   bytes  shift/OR    scalar    vector\n");
+    for (int i=0; i<PACK_SIZES; ++i)
+    {
+        int count = (pack_bytes[i] + 3) / 4;
+        int loops = BENCH_WORDS / count;
+        u64 usec[3];
+
+        start = hrclock_usec();
+        for (int n=0; n<loops; ++n) {pack_words_before(src, words, count); sink = words[n % count];}
+        usec[0] = hrclock_usec() - start;
+
+        start = hrclock_usec();
+        for (int n=0; n<loops; ++n) {pack_words_scalar(src, words, count); sink = words[n % count];}
+        usec[1] = hrclock_usec() - start;
+
+        start = hrclock_usec();
+        for (int n=0; n<loops; ++n) {pack_words(src, words, count); sink = words[n % count];}
+        usec[2] = hrclock_usec() - start;
+
+        u64 total = (u64)loops * count;
+        printf("%8i %9.1f %9.1f %9.1f\n", pack_bytes[i], mwords_per_sec(total, usec[0]),
+               mwords_per_sec(total, usec[1]), mwords_per_sec(total, usec[2]));
+    }
+    (void)sink;
+
+    // Then whole messages thru try_send() into the emulated FIFO, from a buffer that's on a
+    // 32-bit boundary and from one that isn't.  Emptying the FIFO is part of what's timed
+    printf("\nH2F messages thru try_send(), emulated FIFO (Mwords/sec)\n");
+    printf("   bytes   aligned unaligned\n");
+    fifo.set_output_depth(EMU_FIFO_DEPTH);
+    for (int i=0; i<PACK_SIZES; ++i)
+    {
+        int count = (pack_bytes[i] + 3) / 4 + 2;
+        int loops = BENCH_WORDS / count;
+        u64 usec[2];
+
+        for (int a=0; a<2; ++a)
+        {
+            gxip_packet_t& message = *(gxip_packet_t*)(buffer + a);
+            message.length_h = pack_bytes[i] >> 8;
+            message.length_l = pack_bytes[i];
+
+            start = hrclock_usec();
+            for (int n=0; n<loops; ++n)
+            {
+                fifo.start_gxip(tx, message);
+                fifo.try_send(tx);
+                h2f->flush();
+            }
+            usec[a] = hrclock_usec() - start;
+        }
+
+        u64 total = (u64)loops * count;
+        printf("%8i %9.1f %9.1f\n", pack_bytes[i], mwords_per_sec(total, usec[0]),
+               mwords_per_sec(total, usec[1]));
+    }
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// main() - Sets up an emulated register window and runs each benchmark
+//=================================================================================================
+int main()
+{
+    CMemMap   mm;
+    CFpgaFifo fifo;
+
+    // Create the emulated register window that our FIFOs live in
+    if (!mm.open_emulated(HW_REGS_SPAN) || !fifo.init(mm))
+    {
+        printf("Can't create the emulated register window\n");
+        return 1;
+    }
+
+    // Find the emulated FIFOs
+    emu_fifo_t* f2h = (emu_fifo_t*)mm[F2H_FIFO_DATA];
+    emu_fifo_t* h2f = (emu_fifo_t*)mm[H2F_FIFO_DATA];
+
+    // And run the benchmarks
+    bench_read(fifo, f2h);
+    bench_pack(fifo, h2f);
+    return 0;
+}
+//=================================================================================================
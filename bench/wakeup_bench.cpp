@@ -0,0 +1,336 @@
+//=================================================================================================
+// wakeup_bench.cpp - Measures how long it takes transact() to wake the FW listener, with the pipe
+//                    it used to write to and with the SPSC queue and eventfd doorbell it uses now
+//
+// Build and run it with "make bench".  Both ways of waking the listener are reproduced here in
+// miniature, so the only thing being timed is the hand-off from one thread to the other.
+//=================================================================================================
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <atomic>
+#include <algorithm>
+#include "typedefs.h"
+#include "cthread.h"
+#include "spsc_queue.h"
+
+
+//=================================================================================================
+// This is how many wakeups we time for each method, and how many messages we queue when timing
+// what it costs to queue a message while the listener is awake
+//=================================================================================================
+#define WAKEUPS         20000
+#define QUEUED_MSGS     (4 * 1024 * 1024)
+//=================================================================================================
+
+
+//=================================================================================================
+// This is how long the producer waits before each message, so that the listener is asleep
+//=================================================================================================
+#define SLEEP_USEC      50
+//=================================================================================================
+
+
+//=================================================================================================
+// This is the depth of the queue between the producer and the listener, the same as the
+// listener's FWL_MAX_PENDING
+//=================================================================================================
+#define QUEUE_DEPTH     64
+//=================================================================================================
+
+
+//=================================================================================================
+// bench_msg_t - A message handed from the producer to the listener.  It's about the size of a
+//               fwl_pending_t, and carries the time it was queued
+//=================================================================================================
+struct bench_msg_t
+{
+    u64     sent_nsec;
+    u8      packet[1100];
+};
+//=================================================================================================
+
+
+//=================================================================================================
+// clock_nsec() - Returns the number of nanoseconds since some arbitrary point in the past
+//=================================================================================================
+static inline u64 clock_nsec()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// CWakeupTest - The common parts of both methods.  The listener thread records how long each
+//               message took to reach it, and the producer waits for each one to be received
+//               before it queues the next
+//=================================================================================================
+class CWakeupTest : public CThread
+{
+public:
+
+    // Constructor
+    CWakeupTest() {m_received = 0;}
+
+    // Called by the producer.  Queues a message and wakes the listener if it needs waking
+    virtual void send(bench_msg_t& msg) = 0;
+
+    // Called by the producer.  Waits until the listener has received "count" messages
+    void    wait_for(int count) {while (m_received < count) sched_yield();}
+
+    // The time each message took to reach the listener, in nanoseconds
+    u64     latency[WAKEUPS];
+
+protected:
+
+    // Called by the listener when a message arrives
+    void    receive(bench_msg_t& msg)
+    {
+        int n = m_received;
+        latency[n] = clock_nsec() - msg.sent_nsec;
+        m_received = n + 1;
+    }
+
+    // The number of messages the listener has received
+    std::atomic<int> m_received;
+};
+//=================================================================================================
+
+
+//=================================================================================================
+// CPipeTest - The way transact() used to work: the message goes into a queue under a lock, and
+//             a byte written to a pipe wakes the listener, which polls the pipe and drains it
+//=================================================================================================
+class CPipeTest : public CWakeupTest
+{
+public:
+
+    // Constructor
+    CPipeTest()
+    {
+        m_head = m_count = 0;
+        pipe(m_pipe);
+        fcntl(m_pipe[0], F_SETFL, O_NONBLOCK);
+    }
+
+    // Called by the producer
+    void    send(bench_msg_t& msg)
+    {
+        m_queue_cs.lock();
+        memcpy(&m_queue[(m_head + m_count) % QUEUE_DEPTH], &msg, sizeof msg);
+        ++m_count;
+        m_queue_cs.unlock();
+        write(m_pipe[1], "", 1);
+    }
+
+    // Called by the producer when nobody is listening, to keep the queue and the pipe from
+    // filling up
+    void    drain()
+    {
+        char buffer[64];
+        m_head = m_count = 0;
+        while (read(m_pipe[0], buffer, sizeof buffer) > 0);
+    }
+
+protected:
+
+    // The listener
+    void    main(void* p1, void* p2, void* p3)
+    {
+        char   buffer[64];
+        pollfd fds = {m_pipe[0], POLLIN, 0};
+
+        while (m_received < WAKEUPS)
+        {
+            // Sleep until the producer writes to the pipe, then drain it
+            poll(&fds, 1, -1);
+            while (read(m_pipe[0], buffer, sizeof buffer) > 0);
+
+            // Take every message that's waiting
+            while (true)
+            {
+                m_queue_cs.lock();
+                bool is_empty = (m_count == 0);
+                m_queue_cs.unlock();
+                if (is_empty) break;
+                receive(m_queue[m_head]);
+                m_queue_cs.lock();
+                m_head = (m_head + 1) % QUEUE_DEPTH;
+                --m_count;
+                m_queue_cs.unlock();
+            }
+        }
+    }
+
+    // The queue of messages, and the lock that protects it
+    PCriticalSection m_queue_cs;
+    bench_msg_t      m_queue[QUEUE_DEPTH];
+    int              m_head, m_count;
+
+    // The pipe that wakes the listener
+    int              m_pipe[2];
+};
+//=================================================================================================
+
+
+//=================================================================================================
+// CDoorbellTest - The way transact() works now: the message is published to an SPSC queue, and
+//                 the eventfd doorbell is rung only if the listener is asleep, or about to be
+//=================================================================================================
+class CDoorbellTest : public CWakeupTest
+{
+public:
+
+    // Constructor
+    CDoorbellTest()
+    {
+        m_doorbell    = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        m_is_sleeping = false;
+    }
+
+    // Called by the producer
+    void    send(bench_msg_t& msg)
+    {
+        bench_msg_t* p_msg = m_queue.alloc();
+        memcpy(p_msg, &msg, sizeof msg);
+        m_queue.publish();
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (m_is_sleeping) eventfd_write(m_doorbell, 1);
+    }
+
+    // Called by the producer when nobody is listening, to keep the queue from filling up
+    void    drain()
+    {
+        while (m_queue.peek()) m_queue.discard();
+    }
+
+protected:
+
+    // The listener
+    void    main(void* p1, void* p2, void* p3)
+    {
+        eventfd_t    count;
+        bench_msg_t* p_msg;
+        pollfd       fds = {m_doorbell, POLLIN, 0};
+
+        while (m_received < WAKEUPS)
+        {
+            // Tell the producer to ring the doorbell, and sleep unless a message beat us to it
+            m_is_sleeping = true;
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (m_queue.empty()) poll(&fds, 1, -1);
+            m_is_sleeping = false;
+            eventfd_read(m_doorbell, &count);
+
+            // Take every message that's waiting
+            while ((p_msg = m_queue.peek()))
+            {
+                receive(*p_msg);
+                m_queue.discard();
+            }
+        }
+    }
+
+    // The queue of messages
+    CSpscQueue<bench_msg_t, QUEUE_DEPTH> m_queue;
+
+    // The doorbell, and whether the listener is asleep
+    int                 m_doorbell;
+    std::atomic<bool>   m_is_sleeping;
+};
+//=================================================================================================
+
+
+//=================================================================================================
+// bench_wakeup() - Times WAKEUPS messages from the producer to a sleeping listener, and prints
+//                  the median, 99th percentile and mean latency, and what the producer spent
+//                  queuing each message
+//=================================================================================================
+static void bench_wakeup(const char* name, CWakeupTest& test)
+{
+    static bench_msg_t msg;
+    u64 send_nsec = 0;
+
+    // Start the listener
+    test.spawn();
+
+    // Hand it one message at a time, giving it time to go back to sleep before each one
+    for (int i=0; i<WAKEUPS; ++i)
+    {
+        test.wait_for(i);
+        usleep(SLEEP_USEC);
+        u64 start = clock_nsec();
+        msg.sent_nsec = start;
+        test.send(msg);
+        send_nsec += clock_nsec() - start;
+    }
+
+    // Wait for the listener to receive the last one
+    test.wait_for(WAKEUPS);
+    test.join();
+
+    // And report the results
+    u64* latency = test.latency;
+    u64  total   = 0;
+    for (int i=0; i<WAKEUPS; ++i) total += latency[i];
+    std::sort(latency, latency + WAKEUPS);
+    printf("%-10s %8.2f %8.2f %8.2f %8.2f\n", name,
+           latency[WAKEUPS / 2] / 1000.0, latency[WAKEUPS * 99 / 100] / 1000.0,
+           (double)total / WAKEUPS / 1000.0, (double)send_nsec / WAKEUPS / 1000.0);
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// bench_queue() - Measures what it costs the producer to queue a message while the listener is
+//                 awake and busy, and prints it in nanoseconds per message
+//=================================================================================================
+template <class T> static void bench_queue(const char* name, T& test)
+{
+    static bench_msg_t msg;
+
+    u64 start = clock_nsec();
+    for (int i=0; i<QUEUED_MSGS; ++i)
+    {
+        test.send(msg);
+        if (i % QUEUE_DEPTH == QUEUE_DEPTH - 1) test.drain();
+    }
+    u64 elapsed = clock_nsec() - start;
+
+    printf("%-10s %8.1f\n", name, (double)elapsed / QUEUED_MSGS);
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// main() - Runs each benchmark
+//=================================================================================================
+int main()
+{
+    // First, how long a sleeping listener takes to see a message
+    printf("\nWakeup latency, producer to sleeping listener (usec)\n");
+    printf("method       median      p99     mean     send\n");
+    CPipeTest*     pipe_test     = new CPipeTest;
+    CDoorbellTest* doorbell_test = new CDoorbellTest;
+    bench_wakeup("pipe",     *pipe_test);
+    bench_wakeup("doorbell", *doorbell_test);
+    delete pipe_test;
+    delete doorbell_test;
+
+    // Then what it costs to queue a message when the listener is already awake
+    printf("\nQueuing a message while the listener is awake (nsec/message)\n");
+    static CPipeTest     pipe_busy;
+    static CDoorbellTest doorbell_busy;
+    bench_queue("pipe",     pipe_busy);
+    bench_queue("doorbell", doorbell_busy);
+    return 0;
+}
+//=================================================================================================
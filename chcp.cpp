@@ -18,8 +18,8 @@ static sMAC broadcast_mac;
 
 
 //=================================================================================================
-// reset_server_connections() - Causes all servers to drop any existing connection and go back
-//                              to listening for new ones
+// reset_server_connections() - Causes all servers to drop any existing connection.  Their
+//                              listening sockets stay open, so hosts may reconnect right away
 //=================================================================================================
 static void reset_server_connections()
 {
@@ -28,9 +28,6 @@ static void reset_server_connections()
 
     // Ask all of the servers to drop any connection they happen to have open
     for (int i=0; i<MAX_GXIP_SERVERS; ++i) Server[i].reset_connection();
-
-    // Give the servers a second to come back up
-    sleep(1);
 }
 //=================================================================================================
 
@@ -41,18 +38,24 @@ static void reset_server_connections()
 //=================================================================================================
 void CCHCP::main(void* p1, void* p2, void* p3)
 {
-    u8        message[300];
     UDPSocket sock;
     u32       source_ip;
 
+    // A device broadcast carries a GXIP command without its 3-byte GXIP header, starting at
+    // offset 8 of the message.  handle_chcp_device_bcast() builds that header in place, just in
+    // front of the command.  We leave 3 bytes of headroom in front of the message so that the
+    // GXIP packet it builds lands on a 32-bit boundary and goes to the FIFO the fast way.
+    alignas(4) u8 buffer[3 + 300];
+    u8* message = buffer + 3;
+
     // Map all of our message types over the message buffer
-    sCHCP_HEADER        &header            = *(sCHCP_HEADER        *)&message;
-    sCHCP_PING          &msg_ping          = *(sCHCP_PING          *)&message;
-    sCHCP_PING_TO       &msg_ping_to       = *(sCHCP_PING_TO       *)&message;
-    sCHCP_ASSIGN_IP     &msg_assign_ip     = *(sCHCP_ASSIGN_IP     *)&message;
-    sCHCP_SET_IP        &msg_set_ip        = *(sCHCP_SET_IP        *)&message;
-    sCHCP_ASSIGN_LETTER &msg_assign_letter = *(sCHCP_ASSIGN_LETTER *)&message;
-    sCHCP_DEVICE_BCAST  &msg_device_bcast  = *(sCHCP_DEVICE_BCAST  *)&message;
+    sCHCP_HEADER        &header            = *(sCHCP_HEADER        *)message;
+    sCHCP_PING          &msg_ping          = *(sCHCP_PING          *)message;
+    sCHCP_PING_TO       &msg_ping_to       = *(sCHCP_PING_TO       *)message;
+    sCHCP_ASSIGN_IP     &msg_assign_ip     = *(sCHCP_ASSIGN_IP     *)message;
+    sCHCP_SET_IP        &msg_set_ip        = *(sCHCP_SET_IP        *)message;
+    sCHCP_ASSIGN_LETTER &msg_assign_letter = *(sCHCP_ASSIGN_LETTER *)message;
+    sCHCP_DEVICE_BCAST  &msg_device_bcast  = *(sCHCP_DEVICE_BCAST  *)message;
 
     // CHCP clients will send us CHCP messages on port 1216
     sock.create_listener(1216);
@@ -60,7 +63,7 @@ void CCHCP::main(void* p1, void* p2, void* p3)
 again:
 
     // Fetch a UDP packet
-    sock.get(message, sizeof(message), &source_ip);
+    sock.get(message, sizeof(buffer) - 3, &source_ip);
 
     // If this CHCP message isn't intended for us, ignore it
     if (header.MAC != broadcast_mac && header.MAC != Network.mac()) goto again;
@@ -266,8 +269,9 @@ void CCHCP::handle_chcp_device_bcast(u8 command_length, u8* command)
     gxip.set_length(command_length+3);
     gxip.type = CMD_PKT;
 
-    // Perform this transaction, ignoring the resulting ACK from the firmware
-    FWListener.transact(gxip, true);
+    // Perform this transaction.  There is no connection to send the resulting ACK to, so the
+    // listener discards it
+    FWListener.transact(gxip, conn_ref_t());
 }
 //=================================================================================================
 
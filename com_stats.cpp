@@ -0,0 +1,82 @@
+//=================================================================================================
+// com_stats.cpp - Implements the communication statistics that each server keeps about its clients
+//=================================================================================================
+#include "com_stats.h"
+
+
+//=================================================================================================
+// These are the codes in the first payload byte of a GXIP handshake
+//=================================================================================================
+#define HSK_NAK     'N'
+#define HSK_CAN     'C'
+#define HSK_BUSY    'B'
+//=================================================================================================
+
+
+//=================================================================================================
+// count_in() - Counts a GXIP message received from a client
+//=================================================================================================
+void com_stats_t::count_in(const void* message, int length)
+{
+    const u8* p = (const u8*)message;
+
+    // Count the message by its type
+    u8 type = p[2];
+    if (type < COM_PKT_TYPES) bump(msgs_in[type]);
+
+    // If the client is NAKing or cancelling something we sent, count that
+    if (type == HSK_PKT && length > 3)
+    {
+        if (p[3] == HSK_NAK) bump(naks_in);
+        if (p[3] == HSK_CAN) bump(cans_in);
+    }
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// count_out() - Counts a GXIP message being sent to a client
+//=================================================================================================
+void com_stats_t::count_out(const void* message, int length)
+{
+    const u8* p = (const u8*)message;
+
+    // Count the message by its type
+    u8 type = p[2];
+    if (type < COM_PKT_TYPES) bump(msgs_out[type]);
+
+    // Missing Response Messages are generated in lieu of a response
+    if (type == MRM_PKT) bump(mrms_out);
+
+    // Count the handshakes that mean something didn't go well
+    if (type == HSK_PKT && length > 3)
+    {
+        if (p[3] == HSK_NAK ) bump(naks_out);
+        if (p[3] == HSK_CAN ) bump(cans_out);
+        if (p[3] == HSK_BUSY) bump(busys_out);
+    }
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// reset() - Clears every counter
+//=================================================================================================
+void com_stats_t::reset()
+{
+    bytes_in  = 0;
+    bytes_out = 0;
+    for (int i=0; i<COM_PKT_TYPES; ++i)
+    {
+        msgs_in [i] = 0;
+        msgs_out[i] = 0;
+    }
+    naks_in   = 0;
+    naks_out  = 0;
+    cans_in   = 0;
+    cans_out  = 0;
+    busys_out = 0;
+    mrms_out  = 0;
+    dropped   = 0;
+}
+//=================================================================================================
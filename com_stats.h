@@ -0,0 +1,53 @@
+//=================================================================================================
+// com_stats.h - Defines the communication statistics that each server keeps about its clients
+//=================================================================================================
+#pragma once
+#include <atomic>
+#include "gxip_struct.h"
+#include "typedefs.h"
+
+//=================================================================================================
+// Messages are counted by GXIP packet type.  Every type is less than this
+//=================================================================================================
+#define COM_PKT_TYPES   12
+//=================================================================================================
+
+
+//=================================================================================================
+// com_stats_t - Counts of the traffic between a server and its clients.
+//
+// A server's connections, the server thread, and the firmware listener all update these at the
+// same time, so every counter is an atomic that's bumped without a lock.  They're "relaxed", so a
+// snapshot may be a few counts out of step with itself, which doesn't matter for statistics.
+//=================================================================================================
+struct com_stats_t
+{
+    std::atomic<u64>    bytes_in;               // Bytes received from clients
+    std::atomic<u64>    bytes_out;              // Bytes sent to clients
+    std::atomic<u64>    msgs_in [COM_PKT_TYPES];// Messages received from clients, by type
+    std::atomic<u64>    msgs_out[COM_PKT_TYPES];// Messages queued for clients, by type
+    std::atomic<u64>    naks_in;                // NAK handshakes received from clients
+    std::atomic<u64>    naks_out;               // NAK handshakes sent to clients
+    std::atomic<u64>    cans_in;                // CAN handshakes received from clients
+    std::atomic<u64>    cans_out;               // CAN handshakes sent to clients
+    std::atomic<u64>    busys_out;              // BUSY handshakes sent to clients
+    std::atomic<u64>    mrms_out;               // Missing Response Messages sent to clients
+    std::atomic<u64>    dropped;                // Commands and requests that never reached the firmware
+
+    // Constructor
+    com_stats_t() {reset();}
+
+    // Counts a message received from, or sent to, a client
+    void    count_in (const void* message, int length);
+    void    count_out(const void* message, int length);
+
+    // Adds to a counter
+    static void bump(std::atomic<u64>& counter, u64 amount = 1)
+    {
+        counter.fetch_add(amount, std::memory_order_relaxed);
+    }
+
+    // Clears every counter
+    void    reset();
+};
+//=================================================================================================
@@ -9,6 +9,32 @@
 #define SPEC_EEPROM_IS_FILE "EEPROM_IS_FILE"
 #define SPEC_SANDBOX        "SANDBOX"
 #define SPEC_LOCK_FS        "LOCK_FS"
+#define SPEC_FIFO_UIO       "FIFO_UIO"
+#define SPEC_FIFO_SPIN_USEC "FIFO_SPIN_USEC"
+#define SPEC_FIFO_SPIN_ADPT "FIFO_SPIN_ADAPTIVE"
+#define SPEC_FIFO_BACKOFF   "FIFO_BACKOFF_MAX_USEC"
+#define SPEC_FIFO_DEADLINE  "FIFO_MSG_DEADLINE_MS"
+#define SPEC_FIFO_H2F_DEPTH "FIFO_H2F_DEPTH"
+#define SPEC_FIFO_SEQ_TAGS  "FIFO_SEQ_TAGS"
+#define SPEC_FW_TXN_WINDOW  "FW_TXN_WINDOW"
+#define SPEC_FW_TXN_QUEUE   "FW_TXN_QUEUE_DEPTH"
+#define SPEC_FW_COALESCE    "FW_COALESCE_REQS"
+#define SPEC_FW_PRIORITY    "FW_PRIORITIES"
+#define SPEC_FW_EXT_PRIO    "FW_EXT_PRIORITY"
+#define SPEC_FW_TMO_PCT     "FW_TIMEOUT_PERCENTILE"
+#define SPEC_FW_TMO_FACTOR  "FW_TIMEOUT_FACTOR"
+#define SPEC_FW_TMO_MIN_MS  "FW_TIMEOUT_MIN_MS"
+#define SPEC_FW_TMO_SAMPLES "FW_TIMEOUT_MIN_SAMPLES"
+#define SPEC_FW_HSK_TMO     "FW_HSK_TIMEOUTS"
+#define SPEC_FW_RSP_TMO     "FW_RSP_TIMEOUTS"
+#define SPEC_RSP_CACHE_TTL  "RSP_CACHE_TTLS"
+#define SPEC_FW_STATUS_PIO  "FW_STATUS_PIO"
+#define SPEC_FW_STATUS_UIO  "FW_STATUS_UIO"
+#define SPEC_SRV_TX_HIWATER "SRV_TX_HIGH_WATER"
+#define SPEC_MEMMAP         "MEMMAP"
+#define SPEC_EMU_HSK_USEC   "EMU_HSK_USEC"
+#define SPEC_EMU_RSP_USEC   "EMU_RSP_USEC"
+#define SPEC_EMU_EVENT_MS   "EMU_EVENT_MS"
 
 // Specs from the EEPROM
 #define SPEC_INSTRUMENT_SN  "INSTRUMENT_SN"
@@ -17,3 +43,9 @@
 // When we operating as our own gateway, the module appears
 // to be in this slot.  (slots are number 0 thru 3)
 #define ASSUMED_SLOT        0
+
+// Our TCP servers let the OS queue this many connections that we haven't accepted yet, and
+// aren't woken up for a new connection until the client sends something (or this many seconds
+// have passed)
+#define LISTEN_BACKLOG      16
+#define DEFER_ACCEPT_SEC    1
@@ -0,0 +1,18 @@
+//=================================================================================================
+// hrclock.h - Monotonic, high-resolution timestamps for measuring latencies and deadlines
+//=================================================================================================
+#pragma once
+#include <time.h>
+#include "typedefs.h"
+
+//=================================================================================================
+// hrclock_usec() - Returns the number of microseconds since some arbitrary point in the past.
+//                  This clock never jumps backwards, even if the wall-clock time is changed.
+//=================================================================================================
+static inline u64 hrclock_usec()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+//=================================================================================================
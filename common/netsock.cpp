@@ -149,6 +149,9 @@ bool CNetSock::create_server(int port)
 	int optval = 1;
 	setsockopt(m_sd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof optval);
 
+	// And allow a new copy of the program to bind it while an old one is still shutting down
+	setsockopt(m_sd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof optval);
+
 	// Make sure the server addr structure is all zeros
 	memset(&m_serv_addr, 0, sizeof(m_serv_addr));
 
@@ -180,22 +183,26 @@ bool CNetSock::create_server(int port)
 //=================================================================================================
 void CNetSock::set_nagling(bool flag)
 {
-	setsockopt(m_sd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof flag);
+	// TCP_NODELAY is the opposite of nagling, and the kernel insists that it be an int
+	int nodelay = flag ? 0 : 1;
+	setsockopt(m_sd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof nodelay);
 }
 //=================================================================================================
 
 
 
 //=================================================================================================
-// Accept() - This accepts an incoming connection
+// listen() - Tells the OS to start queueing incoming connections on this server socket
+//
+// Passed:  backlog = How many connections the OS may queue before we accept them
 //=================================================================================================
-bool CNetSock::accept(CNetSock* newsock)
+bool CNetSock::listen(int backlog)
 {
     // If we're not created yet, don't even think about it
     if (!m_is_created) return false;
 
     // Tell the OS to start listening at this socket's port number
-    int status = listen(m_sd, 1);
+    int status = ::listen(m_sd, backlog);
 
     // If listen() barfed on us, tell the caller
     if (status < 0)
@@ -208,6 +215,34 @@ bool CNetSock::accept(CNetSock* newsock)
 
     // The socket is now listening
     m_is_listening = true;
+    return true;
+}
+//=================================================================================================
+
+
+
+//=================================================================================================
+// set_defer_accept() - Asks the OS not to hand us a new connection until the client has sent
+//                      something, or until "seconds" have passed
+//=================================================================================================
+void CNetSock::set_defer_accept(int seconds)
+{
+	setsockopt(m_sd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &seconds, sizeof seconds);
+}
+//=================================================================================================
+
+
+
+//=================================================================================================
+// Accept() - This accepts an incoming connection
+//=================================================================================================
+bool CNetSock::accept(CNetSock* newsock)
+{
+    // If we're not created yet, don't even think about it
+    if (!m_is_created) return false;
+
+    // Make sure the OS is listening at this socket's port number
+    if (!m_is_listening && !listen()) return false;
 
     // Find the size of a sockaddr_in structure
     socklen_t addr_size = sizeof(m_cli_addr);
@@ -259,7 +294,7 @@ bool CNetSock::accept_nonblocking()
     if (!m_is_created) return false;
 
     // Tell the OS to start listening at this socket's port number
-    if (!m_is_listening) listen(m_sd, 1);
+    if (!m_is_listening) ::listen(m_sd, 1);
 
     // The socket is now listening
     m_is_listening = true;
@@ -43,6 +43,12 @@ public:
 	// Call this to turn nagling on and off
 	void	set_nagling(bool flag);
 
+	// Starts queueing incoming connections without waiting for one
+	bool	listen(int backlog = 1);
+
+	// Don't accept a connection until the client has sent something
+	void	set_defer_accept(int seconds);
+
 	// Accepts an incoming connection
 	bool 	accept(CNetSock* newsock = NULL);
 
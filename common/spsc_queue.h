@@ -0,0 +1,94 @@
+//=================================================================================================
+// spsc_queue.h - A lock-free, fixed capacity queue with exactly one producer and one consumer
+//=================================================================================================
+#pragma once
+#include <atomic>
+
+//=================================================================================================
+// CSpscQueue - A ring of N entries of type T.  Exactly one thread may call push() and exactly
+//              one (other) thread may call pop().  Neither side ever blocks or takes a lock.
+//
+// For large entries, the producer can fill an entry in place with alloc() and publish(), and
+// the consumer can use an entry in place with peek() and discard(), so nothing is copied.
+//
+// N must be a power of two
+//=================================================================================================
+template <class T, unsigned N> class CSpscQueue
+{
+    static_assert((N & (N-1)) == 0, "CSpscQueue capacity must be a power of two");
+
+public:
+
+    // Constructor
+    CSpscQueue() {m_head = 0; m_tail = 0;}
+
+    // Appends an entry.  Returns false if the queue is full
+    bool    push(const T& value)
+    {
+        unsigned h = m_head.load(std::memory_order_relaxed);
+        if (h - m_tail.load(std::memory_order_acquire) == N) return false;
+        m_ring[h % N] = value;
+        m_head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Removes the oldest entry.  Returns false if the queue is empty
+    bool    pop(T* p_value)
+    {
+        unsigned t = m_tail.load(std::memory_order_relaxed);
+        if (t == m_head.load(std::memory_order_acquire)) return false;
+        *p_value = m_ring[t % N];
+        m_tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Producer: returns the entry that the next publish() will append, or nullptr if the queue
+    // is full.  The entry isn't visible to the consumer until it's published
+    T*      alloc()
+    {
+        unsigned h = m_head.load(std::memory_order_relaxed);
+        if (h - m_tail.load(std::memory_order_acquire) == N) return nullptr;
+        return &m_ring[h % N];
+    }
+
+    // Producer: appends the entry returned by alloc()
+    void    publish()
+    {
+        m_head.store(m_head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    // Consumer: returns the oldest entry without removing it, or nullptr if the queue is empty
+    T*      peek()
+    {
+        unsigned t = m_tail.load(std::memory_order_relaxed);
+        if (t == m_head.load(std::memory_order_acquire)) return nullptr;
+        return &m_ring[t % N];
+    }
+
+    // Consumer: removes the entry returned by peek()
+    void    discard()
+    {
+        m_tail.store(m_tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    // Returns the number of entries in the queue
+    unsigned size() {return m_head.load(std::memory_order_acquire) - m_tail.load(std::memory_order_acquire);}
+
+    // Returns true if there's nothing in the queue
+    bool    empty() {return size() == 0;}
+
+    // Returns the number of entries the queue can hold
+    unsigned capacity() {return N;}
+
+protected:
+
+    // Incremented by the producer, on its own cache line so it doesn't bounce with m_tail
+    alignas(64) std::atomic<unsigned> m_head;
+
+    // Incremented by the consumer
+    alignas(64) std::atomic<unsigned> m_tail;
+
+    // The entries in the queue
+    alignas(64) T m_ring[N];
+};
+//=================================================================================================
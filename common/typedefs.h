@@ -71,4 +71,26 @@ public:
 //============================================================================
 
 
+//============================================================================
+// This is a u64, stored in big-endian order
+//============================================================================
+class u64be
+{
+public:
 
+    u64be& operator=(u64 value)
+    {
+        for (int i=0; i<8; ++i) m_octet[i] = value >> (56 - 8*i);
+        return *this;
+    }
+
+    operator u64()
+    {
+        u64 value = 0;
+        for (int i=0; i<8; ++i) value = (value << 8) | m_octet[i];
+        return value;
+    }
+
+    u8  m_octet[8];
+};
+//============================================================================
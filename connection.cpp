@@ -0,0 +1,345 @@
+//=================================================================================================
+// connection.cpp - Implements one host's TCP connection to a GXIP server
+//=================================================================================================
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include "connection.h"
+
+
+//=================================================================================================
+// Every host that connects to any of our servers gets the next ID from here.  0 is never used
+//=================================================================================================
+static std::atomic<u32> next_conn_id(1);
+//=================================================================================================
+
+
+//=================================================================================================
+// send_gxip_to_host() - Sends a GXIP message to the host, if it's still connected
+//=================================================================================================
+void conn_ref_t::send_gxip_to_host(gxip_packet_t& message)
+{
+    if (conn) conn->send_gxip_to_host(message, id);
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// Constructor() - Nobody is connected yet.  Creates the outbound doorbell
+//=================================================================================================
+CConnection::CConnection()
+{
+    m_is_open     = false;
+    m_id          = 0;
+    m_rx_head     = 0;
+    m_rx_tail     = 0;
+    m_tx_head     = 0;
+    m_tx_tail     = 0;
+    m_tx_overflow = false;
+    m_tx_rung     = false;
+    m_tx_doorbell = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    memset(&m_tx_stats, 0, sizeof m_tx_stats);
+
+    // Our server tells us where to count our traffic before it opens us
+    m_com_stats   = nullptr;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// open() - Starts using this object for a newly accepted socket
+//
+// Passed:  socket = The accepted socket
+//=================================================================================================
+void CConnection::open(CNetSock& socket)
+{
+    // A new host starts out subscribed to nothing, and isn't sent anything queued for the last
+    m_events.clear();
+    m_events.clear_doorbell();
+    while (m_events.peek()) m_events.discard();
+
+    // And nothing has been read from it yet
+    m_rx_head = 0;
+    m_rx_tail = 0;
+
+    // Turn off Nagling on the socket so that data is not buffered after we send it
+    socket.set_nagling(false);
+
+    // Take ownership of the socket and give the new host its ID and an empty outbound queue
+    PSingleLock lock(&m_tx_cs);
+    m_socket      = socket;
+    m_id          = next_conn_id++;
+    m_tx_head     = 0;
+    m_tx_tail     = 0;
+    m_tx_overflow = false;
+    m_is_open     = true;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// close() - Drops the connection.  Replies that arrive for this host after this are discarded
+//=================================================================================================
+void CConnection::close()
+{
+    PSingleLock lock(&m_tx_cs);
+    m_is_open = false;
+    m_socket.close();
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// receive() - Reads as much as has arrived on the socket with a single recv(), without blocking
+//
+// Returns: The number of bytes read (which may be 0), or -1 if the host closed the connection
+//=================================================================================================
+int CConnection::receive()
+{
+    // Everything but the last partial message has been parsed, so slide that to the front of the
+    // buffer.  What's left is always room for several more messages
+    if (m_rx_head)
+    {
+        memmove(m_rx, m_rx + m_rx_head, m_rx_tail - m_rx_head);
+        m_rx_tail -= m_rx_head;
+        m_rx_head  = 0;
+    }
+
+    // If the buffer is full of messages we haven't handled yet, there's no room to read more
+    if (m_rx_tail == CONN_RX_SIZE) return 0;
+
+    // Fetch whatever has arrived
+    int bytes_read = recv(m_socket.get_fd(), m_rx + m_rx_tail, CONN_RX_SIZE - m_rx_tail, MSG_DONTWAIT);
+
+    // If nothing has arrived after all, that's fine
+    if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return 0;
+
+    // If the socket closed or failed, tell the caller
+    if (bytes_read <= 0) return -1;
+
+    // Keep track of how much is in the buffer
+    m_rx_tail += bytes_read;
+    com_stats_t::bump(m_com_stats->bytes_in, bytes_read);
+    return bytes_read;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// next_message() - Takes the next complete GXIP message out of the receive buffer
+//
+// Returns: CONN_MSG_COMPLETE if a message is now in request()
+//          CONN_MSG_PARTIAL  if the rest of the next message hasn't arrived yet
+//          CONN_MSG_CLOSED   if the next message has an impossible length
+//=================================================================================================
+int CConnection::next_message()
+{
+    u8* frame     = m_rx + m_rx_head;
+    int available = m_rx_tail - m_rx_head;
+
+    // Until we have the two length bytes, we don't know how long the message is
+    if (available < 2) return CONN_MSG_PARTIAL;
+
+    // Find out how long the entire message is (including the two length bytes)
+    int length = (frame[0] << 8) | frame[1];
+
+    // If this can't possibly be a valid length, the caller should close the socket
+    if (length < 3 || length > (int)sizeof(m_packet)) return CONN_MSG_CLOSED;
+
+    // If the whole message isn't here yet, we'll finish it after the next receive()
+    if (available < length) return CONN_MSG_PARTIAL;
+
+    // Hand the caller the message
+    memcpy(&m_packet, frame, length);
+    m_rx_head += length;
+    m_com_stats->count_in(frame, length);
+    return CONN_MSG_COMPLETE;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// enqueue() - Copies bytes into the outbound queue.  The caller must hold m_tx_cs
+//=================================================================================================
+void CConnection::enqueue(const void* buffer, int length)
+{
+    u32 head = m_tx_head.load(std::memory_order_relaxed);
+    u32 tail = m_tx_tail.load(std::memory_order_acquire);
+
+    // If the host has fallen so far behind that this won't fit, it's going to be disconnected
+    if (head - tail + length > CONN_TX_SIZE)
+    {
+        m_tx_overflow = true;
+        return;
+    }
+
+    // Copy the bytes in.  If they run off the end of the queue, the rest go at the front
+    u32 index = head & (CONN_TX_SIZE - 1);
+    u32 first = CONN_TX_SIZE - index;
+    if (first > (u32)length) first = length;
+    memcpy(m_tx + index, buffer, first);
+    memcpy(m_tx, (const u8*)buffer + first, length - first);
+
+    // Make them visible to the server thread
+    m_tx_head.store(head + length, std::memory_order_release);
+
+    // Keep track of what we've sent, and how far behind the host gets
+    m_com_stats->count_out(buffer, length);
+    ++m_tx_stats.messages;
+    if (m_tx_stats.high_water < head + length - tail) m_tx_stats.high_water = head + length - tail;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// send() - Called by the server thread to queue bytes for the host
+//=================================================================================================
+void CConnection::send(const void* buffer, int length)
+{
+    PSingleLock lock(&m_tx_cs);
+    if (m_is_open) enqueue(buffer, length);
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// send_gxip_to_host() - Called by other threads to queue a GXIP message for the host, but only if
+//                       it's the same host that conn_id was handed out to
+//=================================================================================================
+void CConnection::send_gxip_to_host(gxip_packet_t& message, u32 conn_id)
+{
+    uint64_t one = 1;
+
+    // Queue the message
+    m_tx_cs.lock();
+    bool is_queued = m_is_open && m_id == conn_id;
+    if (is_queued) enqueue(&message, message.length());
+    m_tx_cs.unlock();
+
+    // Wake up the server thread, unless the doorbell is already ringing
+    if (is_queued && !m_tx_rung.exchange(true)) write(m_tx_doorbell, &one, sizeof one);
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// clear_tx_doorbell() - Clears the outbound doorbell.  Anything queued after this rings it again
+//=================================================================================================
+void CConnection::clear_tx_doorbell()
+{
+    uint64_t count;
+    m_tx_rung = false;
+    read(m_tx_doorbell, &count, sizeof count);
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// flush() - Writes as much of the outbound queue to the socket as it will take, without blocking.
+//           Every message that's waiting goes out in the same sendmsg()
+//
+// Returns: CONN_TX_DONE    if the queue is now empty
+//          CONN_TX_BLOCKED if the socket is full.  Call again when it's writable
+//          CONN_TX_FAILED  if the socket failed, or the queue overflowed earlier
+//=================================================================================================
+int CConnection::flush()
+{
+    // If a message was lost, the host can't make sense of what follows
+    if (m_tx_overflow) return CONN_TX_FAILED;
+
+    while (true)
+    {
+        u32 head = m_tx_head.load(std::memory_order_acquire);
+        u32 tail = m_tx_tail.load(std::memory_order_relaxed);
+
+        // If there's nothing waiting, we're done
+        if (head == tail) return CONN_TX_DONE;
+
+        // The waiting bytes are in one piece, or two if they wrap around the end of the queue
+        u32 index = tail & (CONN_TX_SIZE - 1);
+        u32 count = head - tail;
+        u32 first = CONN_TX_SIZE - index;
+        if (first > count) first = count;
+
+        iovec iov[2];
+        iov[0].iov_base = m_tx + index;
+        iov[0].iov_len  = first;
+        iov[1].iov_base = m_tx;
+        iov[1].iov_len  = count - first;
+
+        msghdr msg;
+        memset(&msg, 0, sizeof msg);
+        msg.msg_iov    = iov;
+        msg.msg_iovlen = (count > first) ? 2 : 1;
+
+        // Send as much as the socket will take
+        int  bytes_sent = sendmsg(m_socket.get_fd(), &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        int  error      = errno;
+        bool is_blocked = (bytes_sent < 0 && (error == EAGAIN || error == EWOULDBLOCK));
+
+        // Count the write.  The CTL thread reads and clears these counts under m_tx_cs
+        m_tx_cs.lock();
+        ++m_tx_stats.writes;
+        if (is_blocked) ++m_tx_stats.blocked;
+        if (bytes_sent > 0) m_tx_stats.bytes += bytes_sent;
+        m_tx_cs.unlock();
+
+        // If the socket is full, the rest will have to wait until it isn't
+        if (is_blocked) return CONN_TX_BLOCKED;
+
+        // If we were interrupted, try again
+        if (bytes_sent < 0 && error == EINTR) continue;
+
+        // Any other failure means the host is gone
+        if (bytes_sent < 0) return CONN_TX_FAILED;
+
+        // Make room in the queue
+        m_tx_tail.store(tail + bytes_sent, std::memory_order_release);
+        com_stats_t::bump(m_com_stats->bytes_out, bytes_sent);
+    }
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// get_tx_stats() - Fetches the counts of what this connection has sent
+//=================================================================================================
+void CConnection::get_tx_stats(conn_tx_stats_t* p_stats)
+{
+    PSingleLock lock(&m_tx_cs);
+    *p_stats = m_tx_stats;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// reset_tx_stats() - Clears the counts of what this connection has sent
+//=================================================================================================
+void CConnection::reset_tx_stats()
+{
+    PSingleLock lock(&m_tx_cs);
+    memset(&m_tx_stats, 0, sizeof m_tx_stats);
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// send_events() - Sends the host every unsolicited message that's waiting for it
+//=================================================================================================
+void CConnection::send_events()
+{
+    // Clear the doorbell before looking, so a message that arrives while we work rings it again
+    m_events.clear_doorbell();
+
+    // Send each waiting message
+    while (gxip_packet_t* packet = m_events.peek())
+    {
+        send_gxip_to_host(*packet);
+        m_events.discard();
+    }
+}
+//=================================================================================================
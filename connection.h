@@ -0,0 +1,221 @@
+//=================================================================================================
+// connection.h - Defines one host's TCP connection to a GXIP server
+//=================================================================================================
+#pragma once
+#include <atomic>
+#include "cthread.h"
+#include "netsock.h"
+#include "gxip_struct.h"
+#include "subscription.h"
+#include "com_stats.h"
+
+class CConnection;
+
+//=================================================================================================
+// This is the size of a connection's receive buffer.  It must hold at least one of the largest
+// GXIP message, and the rest is room for however many more the host has sent
+//=================================================================================================
+#define CONN_RX_SIZE    16384
+//=================================================================================================
+
+
+//=================================================================================================
+// This is the size of a connection's outbound queue, in bytes.  It must be a power of two.  If a
+// host falls so far behind that a message won't fit, the host is disconnected
+//=================================================================================================
+#define CONN_TX_SIZE    65536
+//=================================================================================================
+
+
+//=================================================================================================
+// These are the values that CConnection::flush() returns
+//=================================================================================================
+enum
+{
+    CONN_TX_FAILED = -1,        // The socket failed, or the outbound queue overflowed
+    CONN_TX_DONE,               // Everything in the outbound queue has been sent
+    CONN_TX_BLOCKED             // The socket is full, and the rest has to wait
+};
+//=================================================================================================
+
+
+//=================================================================================================
+// conn_tx_stats_t - Counts of what a connection has sent
+//=================================================================================================
+struct conn_tx_stats_t
+{
+    u64     writes;         // Calls to sendmsg()
+    u64     bytes;          // Bytes sent to the host
+    u64     messages;       // Messages queued for the host
+    u32     blocked;        // Times the socket was too full to take everything
+    u32     high_water;     // The most bytes that have been waiting in the outbound queue
+};
+//=================================================================================================
+
+
+//=================================================================================================
+// These are the values that CConnection::next_message() returns
+//=================================================================================================
+enum
+{
+    CONN_MSG_CLOSED = -1,       // The host sent a message with an impossible length
+    CONN_MSG_PARTIAL,           // No complete message is in the receive buffer
+    CONN_MSG_COMPLETE           // A complete message is in request()
+};
+//=================================================================================================
+
+
+//=================================================================================================
+// conn_ref_t - Refers to a connection for as long as it stays connected to the same host.
+//
+// Connection objects are reused, so a reply that arrives after its host has gone away must not
+// be sent to whoever connected next.  Every new host gets a new connection ID, and sending thru
+// a reference whose ID is stale does nothing.
+//=================================================================================================
+struct conn_ref_t
+{
+    CConnection*  conn;
+    u32           id;
+
+    // Sends a GXIP message to the host, if it's still connected
+    void    send_gxip_to_host(gxip_packet_t& message);
+
+    // A value-initialized reference, conn_ref_t(), refers to nothing.  Messages sent to it are
+    // discarded
+    explicit operator bool() const {return conn != nullptr;}
+};
+//=================================================================================================
+
+
+//=================================================================================================
+// CConnection - One host's TCP connection to a GXIP server.  The server thread reads and parses
+//               messages from it.  Any thread may send messages to it.
+//
+// Sending a message only copies it into the connection's outbound queue, so a slow host never
+// blocks the thread that's replying to it.  The server thread writes the queue to the socket
+// without blocking, many messages at a time.  Threads other than the server thread ring the
+// outbound doorbell to tell it there's something to write.
+//=================================================================================================
+class CConnection
+{
+public:
+
+    // Constructor
+    CConnection();
+
+    // Tells the connection where to count the traffic to and from its host
+    void    set_com_stats(com_stats_t* p_stats) {m_com_stats = p_stats;}
+
+    // Called by the server thread to start using this object for a newly accepted socket
+    void    open(CNetSock& socket);
+
+    // Called by the server thread to drop the connection
+    void    close();
+
+    // Returns true if there's a host on the other end
+    bool    is_open() {return m_is_open;}
+
+    // Returns this connection's ID, which is unique to the host that's connected
+    u32     get_id() {return m_id;}
+
+    // Returns a reference to this connection that other threads can reply thru
+    conn_ref_t ref() {conn_ref_t r; r.conn = this; r.id = m_id; return r;}
+
+    // Returns the file descriptor of the socket
+    int     get_fd() {return m_socket.get_fd();}
+
+    // Reads as much as has arrived on the socket into the receive buffer with a single recv(),
+    // without blocking.  Returns the number of bytes read, or -1 if the host went away
+    int     receive();
+
+    // Takes the next complete message out of the receive buffer and puts it in request()
+    int     next_message();
+
+    // Returns the message that next_message() just took out of the receive buffer
+    gxip_packet_t& request() {return m_packet;}
+
+    // Called by the server thread to queue raw bytes or a GXIP message for the host.  The server
+    // thread flushes the queue itself when it's done handling what woke it up
+    void    send(const void* buffer, int length);
+    void    send_gxip_to_host(gxip_packet_t& message) {send(&message, message.length());}
+
+    // Called by other threads to queue a GXIP message for the host, but only if conn_id is still
+    // the ID of this connection.  This rings the outbound doorbell
+    void    send_gxip_to_host(gxip_packet_t& message, u32 conn_id);
+
+    // Called by the server thread.  Writes as much of the outbound queue as the socket will take
+    int     flush();
+
+    // Returns true if a message didn't fit in the outbound queue and was lost
+    bool    has_overflowed() {return m_tx_overflow;}
+
+    // Returns the number of bytes waiting in the outbound queue
+    u32     tx_backlog() {return m_tx_head.load(std::memory_order_acquire) - m_tx_tail.load(std::memory_order_relaxed);}
+
+    // Returns the outbound doorbell, which is readable when another thread has queued something
+    int     get_tx_fd() {return m_tx_doorbell;}
+
+    // Called by the server thread.  Clears the outbound doorbell.  Do this before flush()
+    void    clear_tx_doorbell();
+
+    // Fetches or clears the counts of what this connection has sent
+    void    get_tx_stats(conn_tx_stats_t* p_stats);
+    void    reset_tx_stats();
+
+    // The unsolicited messages our host has subscribed to, and those waiting to be sent
+    CSubscription& events() {return m_events;}
+
+    // The FIFO demux calls this to offer us an unsolicited message.  Returns true if our host has
+    // subscribed to it
+    bool    offer_event(gxip_packet_t& packet) {return m_is_open && m_events.offer(packet);}
+
+    // Sends the host every unsolicited message that's waiting for it
+    void    send_events();
+
+protected:
+
+    // The socket that's connected to the host
+    CNetSock      m_socket;
+
+    // True while there's a host on the other end
+    std::atomic<bool> m_is_open;
+
+    // The ID of the host that's connected
+    std::atomic<u32>  m_id;
+
+    // Queues "length" bytes for the host.  The caller must hold m_tx_cs
+    void    enqueue(const void* buffer, int length);
+
+    // Only one thread at a time may queue a message, open the connection, or close it
+    PCriticalSection  m_tx_cs;
+
+    // The outbound queue.  m_tx_head and m_tx_tail count bytes ever queued and sent, so the
+    // number waiting is their difference
+    u8                m_tx[CONN_TX_SIZE];
+    std::atomic<u32>  m_tx_head, m_tx_tail;
+
+    // True if a message didn't fit in the outbound queue.  The host is disconnected
+    std::atomic<bool> m_tx_overflow;
+
+    // An eventfd that other threads ring after queueing a message, and true while it's rung
+    int               m_tx_doorbell;
+    std::atomic<bool> m_tx_rung;
+
+    // Counts of what this connection has sent
+    conn_tx_stats_t   m_tx_stats;
+
+    // The server's counts of the traffic to and from all of its hosts
+    com_stats_t*      m_com_stats;
+
+    // The unsolicited messages our host has subscribed to
+    CSubscription m_events;
+
+    // Bytes from the socket.  The ones from m_rx_head to m_rx_tail haven't been parsed yet
+    u8            m_rx[CONN_RX_SIZE];
+    int           m_rx_head, m_rx_tail;
+
+    // The message being handled.  It's on a 32-bit boundary so it goes to the FIFO fast, and it's
+    // full-sized so that a handler may build its response over it
+    alignas(4) gxip_packet_t m_packet;
+};
+//=================================================================================================
@@ -381,6 +381,16 @@ void CDLM::main(void* p1, void* p2, void* p3)
     // Get a convenient name for our side of this pipe
     int special_fd = m_special_pipe[0];
 
+    // Create the server socket and start listening.  It stays open for as long as we run, so a
+    // client that reconnects after we drop it never finds the port closed
+    if (!m_listener.create_server(m_tcp_port) || !m_listener.listen(LISTEN_BACKLOG))
+    {
+        printf("FAILED TO CREATE SERVER ON PORT %i\n", m_tcp_port);
+    }
+
+    // Don't wake us up for a client until it has something to say
+    m_listener.set_defer_accept(DEFER_ACCEPT_SEC);
+
     // Tell the outside world that we are initialized
     m_is_initialized = true;
 
@@ -396,16 +406,12 @@ wait_for_connect:
     // Tell the world what's up
     printf("Waiting for DLM connection on port %i\n", m_tcp_port);
 
-    // Create the server socket
-    if (!m_socket.create_server(m_tcp_port))
-    {
-        printf("FAILED TO CREATE SERVER ON PORT %i\n", m_tcp_port);
-    }
-
-    // Wait for a connection from the outside world
-    if (!m_socket.accept())
+    // Wait for a connection from the outside world.  If that fails, wait a moment and try again
+    if (!m_listener.accept(&m_socket))
     {
         printf("FAILED TO ACCEPT CONNECTIONS ON PORT %i\n", m_tcp_port);
+        sleep(1);
+        goto wait_for_connect;
     }
 
     // There is now a client connected to our socket
@@ -54,6 +54,9 @@ protected:
     bool          m_is_connected;
 
     // This is the server socket that people connect to us on
+    CNetSock      m_listener;
+
+    // This is the socket that's connected to our client
     CNetSock      m_socket;
 
     // This will pointer to a buffer on the heap that contains incoming DLM message
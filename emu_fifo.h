@@ -0,0 +1,61 @@
+//=================================================================================================
+// emu_fifo.h - Defines an emulated 32-bit wide FIFO, used when there is no FPGA
+//=================================================================================================
+#pragma once
+#include <atomic>
+#include "typedefs.h"
+
+//=================================================================================================
+// This is how many 32-bit words an emulated FIFO can hold.  It's deep enough to hold the largest
+// GXIP message, and small enough that an emulated FIFO fits between one FIFO's data port and
+// the next FIFO's control/status register in sopcinfo.h
+//=================================================================================================
+#define EMU_FIFO_DEPTH 768
+//=================================================================================================
+
+
+//=================================================================================================
+// emu_fifo_t - When the register window is emulated, one of these lives in the window at the
+//              address of each FIFO's data port.  Reading the data port of a real FIFO pops a
+//              word, which ordinary memory can't do, so both sides call push() and pop() instead.
+//
+// There is exactly one writer and one reader of each FIFO.  Both start out as all zeros.
+//=================================================================================================
+struct emu_fifo_t
+{
+    // Incremented by the writer each time a word is pushed
+    std::atomic<u32>    head;
+
+    // Incremented by the reader each time a word is popped
+    std::atomic<u32>    tail;
+
+    // The words in the FIFO
+    u32                 words[EMU_FIFO_DEPTH];
+
+    // Returns the number of words in the FIFO
+    u32     level() {return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);}
+
+    // Returns the number of words that can be pushed without overflowing
+    u32     space() {return EMU_FIFO_DEPTH - level();}
+
+    // Writes a word into the FIFO.  The caller must have checked that there's space
+    void    push(u32 word)
+    {
+        u32 h = head.load(std::memory_order_relaxed);
+        words[h % EMU_FIFO_DEPTH] = word;
+        head.store(h + 1, std::memory_order_release);
+    }
+
+    // Reads a word from the FIFO.  Like a real FIFO, reading an empty FIFO returns garbage
+    u32     pop()
+    {
+        u32 t = tail.load(std::memory_order_relaxed);
+        u32 word = words[t % EMU_FIFO_DEPTH];
+        tail.store(t + 1, std::memory_order_release);
+        return word;
+    }
+
+    // Throws away everything in the FIFO
+    void    flush() {tail.store(head.load(std::memory_order_acquire), std::memory_order_release);}
+};
+//=================================================================================================
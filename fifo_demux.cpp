@@ -0,0 +1,207 @@
+//=================================================================================================
+// fifo_demux.cpp - Implements a thread that drains the FIFO from the firmware and routes each
+//                  message to whoever consumes that kind of message
+//=================================================================================================
+#include <unistd.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include "fifo_demux.h"
+#include "globals.h"
+
+
+//=================================================================================================
+// This is how long (in milliseconds) the demux waits for a message before checking again
+//=================================================================================================
+#define DEMUX_POLL_MS   100
+//=================================================================================================
+
+
+//=================================================================================================
+// CFifoMsgQueue() - Constructor.  Creates the doorbell
+//=================================================================================================
+CFifoMsgQueue::CFifoMsgQueue()
+{
+    m_doorbell = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// ~CFifoMsgQueue() - Destructor.  Closes the doorbell
+//=================================================================================================
+CFifoMsgQueue::~CFifoMsgQueue()
+{
+    if (m_doorbell != -1) close(m_doorbell);
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// push() - Appends a message to the queue and rings the doorbell
+//
+// Returns: false if the queue is full, in which case the caller still owns the message
+//=================================================================================================
+bool CFifoMsgQueue::push(fifo_msg_t* msg)
+{
+    uint64_t one = 1;
+
+    // If the queue is full, tell the caller
+    if (!m_queue.push(msg)) return false;
+
+    // Wake up the consumer
+    write(m_doorbell, &one, sizeof one);
+
+    // Tell the caller that the message was queued
+    return true;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// try_pop() - Clears the doorbell, then removes the oldest message from the queue without waiting
+//
+// Returns: The message, or nullptr if the queue is empty.  The caller must release the message
+//
+// A consumer that poll()s on get_fd() should call this until it returns nullptr.  Because the
+// doorbell is cleared before the queue is checked, a message that arrives afterwards rings it again
+//=================================================================================================
+fifo_msg_t* CFifoMsgQueue::try_pop()
+{
+    fifo_msg_t* msg;
+    uint64_t    count;
+
+    // Clear the doorbell
+    read(m_doorbell, &count, sizeof count);
+
+    // And hand the caller the oldest message, if there is one
+    return m_queue.pop(&msg) ? msg : nullptr;
+}
+//=================================================================================================
+
+
+
+//=================================================================================================
+// CFifoDemux() - Constructor
+//=================================================================================================
+CFifoDemux::CFifoDemux()
+{
+    // We haven't routed any messages yet
+    reset_stats();
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// reset_stats() - Clears the counts of the messages we've routed
+//=================================================================================================
+void CFifoDemux::reset_stats()
+{
+    m_strings     = 0;
+    m_handshakes  = 0;
+    m_responses   = 0;
+    m_unsolicited = 0;
+    m_dropped     = 0;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// route() - Routes a single message from the firmware to the queue that consumes it
+//=================================================================================================
+void CFifoDemux::route(fifo_msg_t* msg)
+{
+    CFifoMsgQueue* queue;
+
+    // Strings from the firmware get printed to our console
+    if (msg->type == FIFO_MSG_STRING)
+    {
+        int length = msg->length * 4;
+        if (length > (int)sizeof(msg->payload)) length = sizeof(msg->payload);
+        printf("Firmware: %.*s\n", length, (char*)msg->payload);
+        CommFifo.release(msg);
+        ++m_strings;
+        return;
+    }
+
+    // Throw away anything that isn't a GXIP message, or is too short to have a GXIP header
+    if (msg->type != FIFO_MSG_GXIP || msg->length == 0)
+    {
+        CommFifo.release(msg);
+        ++m_dropped;
+        return;
+    }
+
+    // Map a GXIP packet onto the message
+    gxip_packet_t& packet = msg->gxip();
+
+    // Anything that isn't a handshake or a response was sent on the firmware's own initiative.
+    // Each subscribed host gets its own copy, so we're done with the message right away
+    if (packet.type != HSK_PKT && !packet.is_rsp())
+    {
+        bool is_wanted = false;
+        for (int i=0; i<MAX_GXIP_SERVERS; ++i) if (Server[i].offer_event(packet)) is_wanted = true;
+        CommFifo.release(msg);
+        ++m_unsolicited;
+        if (!is_wanted) ++m_dropped;
+        return;
+    }
+
+    // Decide which queue this message belongs on
+    if (packet.type == HSK_PKT)
+    {
+        queue = &handshakes;
+        ++m_handshakes;
+    }
+    else
+    {
+        queue = &responses;
+        ++m_responses;
+    }
+
+    // If its consumer has fallen behind, drop the message
+    if (!queue->push(msg))
+    {
+        CommFifo.release(msg);
+        ++m_dropped;
+    }
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// main() - When this thread spawns, execution starts here
+//=================================================================================================
+void CFifoDemux::main(void* p1, void* p2, void* p3)
+{
+    while (true)
+    {
+        // If every message slot is still held by a consumer, give them a moment to catch up
+        if (!CommFifo.has_free_slot())
+        {
+            usleep(1000);
+            continue;
+        }
+
+        // Wait for a message from the firmware
+        fifo_msg_t* msg = CommFifo.read_message(DEMUX_POLL_MS);
+
+        // And if there is one, send it where it belongs
+        if (msg) route(msg);
+    }
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// get_stats() - Fetches the counts of the messages we've routed
+//=================================================================================================
+void CFifoDemux::get_stats(fifo_demux_stats_t* p_stats)
+{
+    p_stats->strings     = m_strings;
+    p_stats->handshakes  = m_handshakes;
+    p_stats->responses   = m_responses;
+    p_stats->unsolicited = m_unsolicited;
+    p_stats->dropped     = m_dropped;
+}
+//=================================================================================================
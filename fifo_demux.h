@@ -0,0 +1,96 @@
+//=================================================================================================
+// fifo_demux.h - Defines a thread that drains the FIFO from the firmware and routes each message
+//                to whoever consumes that kind of message
+//=================================================================================================
+#pragma once
+#include <atomic>
+#include "cthread.h"
+#include "fpga_fifo.h"
+#include "spsc_queue.h"
+
+//=================================================================================================
+// CFifoMsgQueue - A lock-free queue of messages from the firmware, with a doorbell that lets the
+//                 consumer sleep until a message arrives.  The demux thread is the only producer,
+//                 and each queue has exactly one consumer.
+//=================================================================================================
+class CFifoMsgQueue
+{
+public:
+
+    // Constructor
+    CFifoMsgQueue();
+
+    // Destructor
+    ~CFifoMsgQueue();
+
+    // Called by the demux thread.  Returns false if the queue is full
+    bool        push(fifo_msg_t* msg);
+
+    // Called by the consumer.  Clears the doorbell and returns a message without waiting
+    fifo_msg_t* try_pop();
+
+    // Returns the doorbell, which is readable whenever a message may be waiting
+    int         get_fd() {return m_doorbell;}
+
+    // Returns the number of messages waiting in the queue
+    int         size() {return m_queue.size();}
+
+protected:
+
+    // The messages waiting to be consumed
+    CSpscQueue<fifo_msg_t*, FIFO_MSG_SLOTS> m_queue;
+
+    // An eventfd that the producer rings each time it pushes a message
+    int         m_doorbell;
+};
+//=================================================================================================
+
+
+//=================================================================================================
+// fifo_demux_stats_t - Counts of the messages the demux has routed
+//=================================================================================================
+struct fifo_demux_stats_t
+{
+    u32     strings;
+    u32     handshakes;
+    u32     responses;
+    u32     unsolicited;
+    u32     dropped;
+};
+//=================================================================================================
+
+
+//=================================================================================================
+// CFifoDemux - Continuously drains the FIFO from the firmware.  Strings are printed to the
+//              console, handshakes and responses are queued for the listener, and any other GXIP
+//              message is unsolicited, and is offered to every host that has subscribed to it.
+//=================================================================================================
+class CFifoDemux : public CThread
+{
+public:
+
+    // Constructor
+    CFifoDemux();
+
+    // When this thread starts up, the entry point is here
+    void    main(void* p1, void* p2, void* p3);
+
+    // Fetches the counts of the messages we've routed
+    void    get_stats(fifo_demux_stats_t* p_stats);
+
+    // Clears the counts of the messages we've routed
+    void    reset_stats();
+
+    // Handshakes and responses from the firmware, consumed by the FW listener
+    CFifoMsgQueue   handshakes;
+    CFifoMsgQueue   responses;
+
+protected:
+
+    // Routes a single message to the appropriate queue
+    void    route(fifo_msg_t* msg);
+
+    // Counts of the messages we've routed
+    std::atomic<u32> m_strings, m_handshakes, m_responses, m_unsolicited, m_dropped;
+};
+//=================================================================================================
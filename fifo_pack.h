@@ -0,0 +1,54 @@
+//=================================================================================================
+// fifo_pack.h - Packs bytes from a buffer that may not be on a 32-bit boundary into the 32-bit
+//               words that the FIFO to the Nios-II carries
+//=================================================================================================
+#pragma once
+#include <string.h>
+#include <stdint.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+
+//=================================================================================================
+// pack_words_scalar() - Packs bytes into 32-bit little-endian words one word at a time.  Since
+//                       both ARM and x86 are little-endian, each word is just an unaligned load
+//=================================================================================================
+static inline void pack_words_scalar(const unsigned char* src, uint32_t* dst, int count)
+{
+    while (count--)
+    {
+        memcpy(dst++, src, 4);
+        src += 4;
+    }
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// pack_words() - Packs bytes into 32-bit little-endian words, sixteen bytes at a time with NEON
+//                or SSE2.  "dst" must be on a 16-byte boundary
+//=================================================================================================
+static inline void pack_words(const unsigned char* src, uint32_t* dst, int count)
+{
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+    while (count >= 4)
+    {
+        vst1q_u32(dst, vreinterpretq_u32_u8(vld1q_u8(src)));
+        src += 16; dst += 4; count -= 4;
+    }
+#elif defined(__SSE2__)
+    while (count >= 4)
+    {
+        _mm_store_si128((__m128i*)dst, _mm_loadu_si128((const __m128i*)src));
+        src += 16; dst += 4; count -= 4;
+    }
+#endif
+
+    // Pack the leftovers (or everything, if we have no vector unit) one word at a time
+    pack_words_scalar(src, dst, count);
+}
+//=================================================================================================
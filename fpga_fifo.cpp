@@ -2,20 +2,26 @@
 // fpga_fifo.cpp - Implements a bidirectional 32-bit wide FIFO to the NIOS-II core
 //=================================================================================================
 #include <unistd.h>
+#include <stdlib.h>
 #include <malloc.h>
+#include <new>
 #include <string.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <atomic>
 #include "fpga_fifo.h"
 #include "sopcinfo.h"
+#include "uio.h"
+#include "hrclock.h"
+#include "cthread.h"
+#include "emu_fifo.h"
+#include "fifo_pack.h"
 
 //=================================================================================================
-// These are the types of messages we can send on the FIFO
+// When waiting on interrupts, the F2H FIFO interrupts us once it holds at least this many words.
+// This is the same threshold that is_message_waiting() uses.
 //=================================================================================================
-enum
-{
-    FIFO_MSG_STRING = 0,
-    FIFO_MSG_GXIP   = 1
-};
+#define F2H_IRQ_THRESHOLD   3
 //=================================================================================================
 
 
@@ -28,11 +34,13 @@ enum
 #define ALTERA_FIFO_CSR_ALMOSTEMPTY (1 << 3)
 #define ALTERA_FIFO_CSR_OVERFLOW    (1 << 4)
 #define ALTERA_FIFO_CSR_UNDERFLOW   (1 << 5)
+#define ALTERA_FIFO_CSR_ALL         0x3F
 
 struct altera_fifo_csr
 {
     uint32_t fill_level;
     uint32_t i_status;
+    uint32_t event;
     uint32_t interuptenable;
     uint32_t almostfull;
     uint32_t almostempty;
@@ -41,6 +49,35 @@ struct altera_fifo_csr
 
 
 
+//=================================================================================================
+// This is the shortest sleep in the exponential back-off that follows a spin
+//=================================================================================================
+#define BACKOFF_START_USEC  50
+//=================================================================================================
+
+
+//=================================================================================================
+// This is the number of words we pack at a time when sending from a buffer that isn't on a
+// 32-bit boundary
+//=================================================================================================
+#define PACK_CHUNK_WORDS    64
+//=================================================================================================
+
+
+//=================================================================================================
+// cpu_relax() - Tells the CPU that we're in a spin-loop
+//=================================================================================================
+static inline void cpu_relax()
+{
+#if defined(__arm__) || defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#elif defined(__i386__) || defined(__x86_64__)
+    __asm__ __volatile__("pause");
+#endif
+}
+//=================================================================================================
+
+
 // The is used to map our private structure to a variable called m
 #define access() pv& m = *(pv*)m_pv
 
@@ -58,9 +95,204 @@ struct pv
     // This points to the control/status register for the input FIFO
     volatile altera_fifo_csr* p_ctrl_in;
 
+    // This points to the control/status register for the output FIFO
+    volatile altera_fifo_csr* p_ctrl_out;
+
+    // When the register window is emulated, these take the place of the FIFO data ports
+    emu_fifo_t* p_emu_in;
+    emu_fifo_t* p_emu_out;
+
+    // The number of 32-bit words the output FIFO can hold
+    int     h2f_depth;
+
+    // Only one thread at a time may write to the output FIFO
+    PCriticalSection send_cs;
+
+    // If a message is partially written to the output FIFO, this points to it
+    fifo_tx_t* p_current_tx;
+
+    // If cancel_send() abandoned a partially written message, this points to it until its owner
+    // next calls try_send() or starts a new message with it.  It's never dereferenced
+    fifo_tx_t* p_cancelled_tx;
+
+    // The ring of slots that incoming messages are read into
+    fifo_msg_t* slots;
+
+    // The index of the slot that the next incoming message will be read into
+    int     next_slot;
+
+    // When this is true, we wait for incoming messages by waiting for an interrupt
+    bool    use_irq;
+
+    // This is the interrupt line of the input FIFO
+    CUio    irq;
+
+    // The longest and shortest we will spin before sleeping, in microseconds
+    int     spin_max_usec, spin_min_usec;
+
+    // When true, the spin budget adapts to how quickly messages have been arriving
+    bool    spin_adaptive;
+
+    // The longest sleep between polls, once the exponential back-off has fully backed off
+    int     backoff_max_usec;
+
+    // This is how long we'll spin on the next wait, in microseconds
+    std::atomic<u32> spin_budget;
+
+    // A moving average of how long callers have waited for a message to arrive, in microseconds
+    u32     avg_latency_usec;
+
+    // Once we've started reading a message, this is how long we'll wait for the rest of it
+    u32     msg_deadline_usec;
+
+    // If a message stalled part way thru, this is how many of its words haven't arrived yet.
+    // They're thrown away as they arrive, so that we don't mistake them for a message header
+    int     f2h_skip_words;
+
+    // Counters that describe how wait_for_message() has been spending its time
+    std::atomic<u32> waits, spin_hits, sleep_hits, irq_hits, timeouts, sleeps;
+    std::atomic<u64> spin_usec;
+
+    // Throughput and health telemetry.  The H2F stats are only written while holding send_cs,
+    // and the F2H stats are only written by the thread that calls read_message()
+    fifo_dir_stats_t h2f_stats, f2h_stats;
 };
 //=================================================================================================
 
+//=================================================================================================
+// These access the FIFOs either through the real hardware registers, or through the emulated
+// FIFOs when there is no FPGA.  Only the data ports and fill levels need this, because they are
+// the only registers where reading or writing has a side-effect.
+//=================================================================================================
+static inline u32 input_level(pv& m)
+{
+    return m.p_emu_in ? m.p_emu_in->level() : m.p_ctrl_in->fill_level;
+}
+
+static inline u32 input_word(pv& m)
+{
+    return m.p_emu_in ? m.p_emu_in->pop() : *m.p_data_in;
+}
+
+static inline u32 output_level(pv& m)
+{
+    return m.p_emu_out ? m.p_emu_out->level() : m.p_ctrl_out->fill_level;
+}
+
+static inline void output_word(pv& m, u32 word)
+{
+    if (m.p_emu_out) m.p_emu_out->push(word); else *m.p_data_out = word;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// note_fill_level() - Records a sample of a FIFO's fill level in its telemetry
+//=================================================================================================
+static inline void note_fill_level(fifo_dir_stats_t& stats, u32 level)
+{
+    // Find the histogram bucket: 0 for empty, then one bucket per power of two
+    int bucket = 0;
+    for (u32 n = level; n && bucket < FIFO_FILL_BUCKETS-1; n >>= 1) ++bucket;
+
+    // And record the sample
+    ++stats.fill_hist[bucket];
+    stats.level = level;
+    if (level > stats.high_water) stats.high_water = level;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// note_fifo_events() - Counts any overflow or underflow that a FIFO has latched in its event
+//                      register, then clears them
+//=================================================================================================
+static inline void note_fifo_events(fifo_dir_stats_t& stats, volatile altera_fifo_csr* csr)
+{
+    // Find out whether the FIFO has overflowed or underflowed since we last looked
+    u32 events = csr->event & (ALTERA_FIFO_CSR_OVERFLOW | ALTERA_FIFO_CSR_UNDERFLOW);
+
+    // Usually it hasn't
+    if (events == 0) return;
+
+    // Count them
+    if (events & ALTERA_FIFO_CSR_OVERFLOW ) ++stats.overflows;
+    if (events & ALTERA_FIFO_CSR_UNDERFLOW) ++stats.underflows;
+
+    // The event bits are write-1-to-clear
+    csr->event = events;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// skip_stalled_words() - Throws away whatever has arrived of the rest of a message that stalled
+//
+// Returns: true if we're done throwing words away, and the next word is a message header
+//=================================================================================================
+static bool skip_stalled_words(pv& m)
+{
+    // Throw away as many of the stalled message's words as have arrived
+    while (m.f2h_skip_words && input_level(m))
+    {
+        input_word(m);
+        ++m.f2h_stats.words;
+        --m.f2h_skip_words;
+    }
+
+    // Tell the caller whether there are more to come
+    return m.f2h_skip_words == 0;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// drain_input() - Throws away everything in the input FIFO
+//=================================================================================================
+static void drain_input(pv& m)
+{
+    while (input_level(m))
+    {
+        input_word(m);
+        ++m.f2h_stats.words;
+    }
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// read_burst() - Reads a known number of words from the input FIFO.  The caller has already
+//                checked the fill level, so we don't need to check whether each word is available
+//=================================================================================================
+static inline void read_burst(pv& m, uint32_t* out, int count)
+{
+    // Get a convenient pointer to the FIFO data port
+    volatile uint32_t* port = m.p_data_in;
+
+    // Emulated FIFOs are read one word at a time
+    if (m.p_emu_in)
+    {
+        while (count--) *out++ = m.p_emu_in->pop();
+        return;
+    }
+
+    // Read the words four at a time...
+    while (count >= 4)
+    {
+        out[0] = *port;
+        out[1] = *port;
+        out[2] = *port;
+        out[3] = *port;
+        out   += 4;
+        count -= 4;
+    }
+
+    // ... and then the leftovers one at a time
+    while (count--) *out++ = *port;
+}
+//=================================================================================================
+
+
 
 //=================================================================================================
 // Constructor() - Allocates private variables
@@ -75,6 +307,28 @@ CFpgaFifo::CFpgaFifo()
 
     // The entire structure starts out cleared to zeros
     memset(m_pv, 0, size);
+
+    // Run the constructors of the members that aren't plain old data
+    new (m_pv) pv;
+
+    // Allocate the ring of incoming message slots, each on its own cache line.  If we can't,
+    // m.slots stays nullptr and init() fails
+    access();
+    void* slots = nullptr;
+    if (posix_memalign(&slots, alignof(fifo_msg_t), FIFO_MSG_SLOTS * sizeof(fifo_msg_t)) == 0)
+    {
+        m.slots = new (slots) fifo_msg_t[FIFO_MSG_SLOTS];
+        for (int i=0; i<FIFO_MSG_SLOTS; ++i) m.slots[i].in_use = false;
+    }
+
+    // By default, don't spin and poll every 20ms, the way we always have
+    set_wait_policy(0, false, 20000);
+
+    // By default, the firmware has 100ms to finish writing a message it has started
+    set_message_deadline(100);
+
+    // Unless we're told otherwise, assume the output FIFO is 256 words deep
+    set_output_depth(256);
 }
 //=================================================================================================
 
@@ -84,6 +338,12 @@ CFpgaFifo::CFpgaFifo()
 //=================================================================================================
 CFpgaFifo::~CFpgaFifo()
 {
+    // Free the ring of incoming message slots
+    if (m_pv) free(((pv*)m_pv)->slots);
+
+    // Run the destructors of the members that aren't plain old data
+    if (m_pv) ((pv*)m_pv)->~pv();
+
     if (m_pv) free(m_pv);
     m_pv = nullptr;
 }
@@ -101,6 +361,13 @@ bool CFpgaFifo::init(CMemMap& mm)
     // Provide access to our private variables
     access();
 
+    // If the constructor couldn't allocate the message slots, we have nowhere to read messages to
+    if (m.slots == nullptr)
+    {
+        printf("Can't allocate the FIFO message slots\n");
+        return false;
+    }
+
     // Fetch a pointer to where we write the data to the output FIFO
     m.p_data_out = (uint32_t*)mm[H2F_FIFO_DATA];
 
@@ -110,8 +377,18 @@ bool CFpgaFifo::init(CMemMap& mm)
     // Fetch a pointer to the input FIFO control registers
     m.p_ctrl_in  = (altera_fifo_csr*)mm[F2H_FIFO_CSR];
 
+    // Fetch a pointer to the output FIFO control registers
+    m.p_ctrl_out = (altera_fifo_csr*)mm[H2F_FIFO_CSR];
+
+    // If there's no FPGA, the FIFO data ports are emulated
+    if (mm.is_emulated())
+    {
+        m.p_emu_out = (emu_fifo_t*)mm[H2F_FIFO_DATA];
+        m.p_emu_in  = (emu_fifo_t*)mm[F2H_FIFO_DATA];
+    }
+
     // Drain the incoming message queue just in case is has garbage in it
-    while (m.p_ctrl_in->fill_level) *m.p_data_in;
+    while (input_level(m)) input_word(m);
 
     // Tell the caller that all is well
     return true;
@@ -120,52 +397,272 @@ bool CFpgaFifo::init(CMemMap& mm)
 
 
 //=================================================================================================
-// send_generic() - Sends any arbitrary message
+// enable_interrupts() - Configures the input FIFO to interrupt us when a message arrives
+//
+// Passed:  uio_device = The UIO device that the F2H FIFO interrupt is routed to, or "sim"
+//
+// Returns: true if interrupts are enabled.  If false, we continue waiting by polling
 //=================================================================================================
-void CFpgaFifo::send_generic(int message_type, int byte_count, const void* buffer)
+bool CFpgaFifo::enable_interrupts(const char* uio_device)
 {
-    uint32_t word = 0;
+    // Provide access to our private variables
+    access();
+
+    // Until we know otherwise, we're polling
+    m.use_irq = false;
+
+    // If we can't open the UIO device, we'll stay with polling
+    if (!m.irq.open(uio_device)) return false;
+
+    // Interrupt when the FIFO holds enough words to be a message.  (The "almost empty" condition
+    // fires when the FIFO drains, so it's the "almost full" threshold that tells us data arrived)
+    m.p_ctrl_in->almostfull     = F2H_IRQ_THRESHOLD;
+    m.p_ctrl_in->interuptenable = ALTERA_FIFO_CSR_ALMOSTFULL;
+
+    // Clear any stale events
+    m.p_ctrl_in->event = ALTERA_FIFO_CSR_ALL;
+
+    // From now on, wait_for_message() will sleep until the FIFO interrupts us
+    m.use_irq = true;
+
+    // Tell the caller that all is well
+    return true;
+}
+//=================================================================================================
+
 
+//=================================================================================================
+// set_output_depth() - Tells us how many 32-bit words the output (H2F) FIFO can hold
+//=================================================================================================
+void CFpgaFifo::set_output_depth(int depth)
+{
     // Provide access to our private variables
     access();
 
-    // Convert the pointer to the input buffer to a byte pointer
-    unsigned char* ptr = (unsigned char*)buffer;
+    m.h2f_depth = depth;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// start_generic() - Prepares a message of an arbitrary type for try_send()
+//=================================================================================================
+void CFpgaFifo::start_generic(fifo_tx_t& tx, int message_type, int byte_count, const void* buffer)
+{
+    // Provide access to our private variables
+    access();
 
-    // How many full 32-bit words are in that string?
+    // How many full 32-bit words are in that message?
     int word_count = byte_count  >> 2;
 
     // Make sure we account for the partially full 32-bit word at the end
     if (byte_count & 3) ++word_count;
 
-    // Write the message type to the FIFO
-    *m.p_data_out = message_type;
+    // The message type and the word count are written to the FIFO ahead of the message body
+    tx.header[0]   = message_type;
+    tx.header[1]   = word_count;
+
+    // This is where the message body starts
+    tx.ptr         = (const unsigned char*)buffer;
+
+    // We have the header and the body to send, and nothing has been sent yet
+    tx.words_total  = word_count + 2;
+    tx.words_sent   = 0;
+    tx.is_cancelled = false;
+
+    // If this fifo_tx_t was abandoned by cancel_send(), that was a different message
+    PSingleLock lock(&m.send_cs);
+    if (m.p_cancelled_tx == &tx) m.p_cancelled_tx = nullptr;
+}
+//=================================================================================================
 
-    // Write the number of 32-bit words to follow
-    *m.p_data_out = word_count;
+
+//=================================================================================================
+// start_gxip() - Prepares a GXIP message for try_send()
+//=================================================================================================
+void CFpgaFifo::start_gxip(fifo_tx_t& tx, gxip_packet_t& message, u16 tag)
+{
+    start_generic(tx, FIFO_MSG_GXIP | (tag << FIFO_MSG_TAG_SHIFT), message.length(), &message);
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// try_send() - Writes as much of a message to the output FIFO as there is room for, and never
+//              waits for room to become available.
+//
+// Returns: The number of 32-bit words written.  The message is completely sent once
+//          tx.is_done() returns true.
+//
+// Once a message has been started, the caller must keep calling try_send() until it is done, or
+// call cancel_send().  Until then, try_send() and send_gxip() for any other message will make no
+// progress.  If cancel_send() abandons the message, the next try_send() marks it done and
+// cancelled, and writes nothing.
+//=================================================================================================
+int CFpgaFifo::try_send(fifo_tx_t& tx)
+{
+    // Provide access to our private variables
+    access();
+
+    // Only one thread at a time may write to the FIFO
+    PSingleLock lock(&m.send_cs);
+
+    // If this message was abandoned part way thru, the rest of it is never written
+    if (m.p_cancelled_tx == &tx)
+    {
+        m.p_cancelled_tx = nullptr;
+        tx.words_sent    = tx.words_total;
+        tx.is_cancelled  = true;
+        return 0;
+    }
+
+    // We can't interleave our message with one that is partially written
+    if (m.p_current_tx && m.p_current_tx != &tx) return 0;
+
+    // Find out how full the output FIFO is
+    u32 level = output_level(m);
+
+    // We're going to write as many of the remaining words as there is room for
+    int count = tx.words_total - tx.words_sent;
+    int space = m.h2f_depth - (int)level;
+    if (space < 0) space = 0;
+    if (count > space) count = space;
+
+    // If there's no room in the FIFO, we can't make any progress
+    if (count == 0) return 0;
+
+    // Sample the fill level once per message, as we start writing it.  Calls that retry a full
+    // FIFO, or that finish a message, aren't samples
+    if (tx.words_sent == 0) note_fill_level(m.h2f_stats, level);
+
+    // Until this message is completely written, no other message may be written
+    m.p_current_tx = &tx;
+
+    // This is how many words we'll have written when we're done
+    int words_written = count;
+
+    // Write whatever part of the header hasn't been written yet
+    while (count && tx.words_sent < 2)
+    {
+        output_word(m, tx.header[tx.words_sent++]);
+        --count;
+    }
+
+    // The rest of the words we write come from the message body
+    tx.words_sent += count;
 
     // Convert that pointer to an address so we can examine it
-    uint64_t address = (uint64_t) ptr;
+    uint64_t address = (uint64_t) tx.ptr;
 
     // If the buffer is on a 32-bit boundary, shovel the data into the FIFO the fast way
     if ((address & 3) == 0)
     {
+        uint32_t* word_ptr = (uint32_t*) tx.ptr;
+        while (count--) output_word(m, *word_ptr++);
+        tx.ptr = (const unsigned char*)word_ptr;
+    }
+
+    // Otherwise, the buffer isn't on a 32-bit boundary, so pack it into words a chunk at a time
+    else while (count)
+    {
+        alignas(16) uint32_t chunk[PACK_CHUNK_WORDS];
 
-        uint32_t* word_ptr = (uint32_t*) ptr;
-        while (word_count--) *m.p_data_out = *word_ptr++;
+        // How many words are we packing this time around?
+        int chunk_words = (count < PACK_CHUNK_WORDS) ? count : PACK_CHUNK_WORDS;
+
+        // Pack the next chunk of the message into 32-bit words
+        pack_words(tx.ptr, chunk, chunk_words);
+        tx.ptr += chunk_words * 4;
+        count  -= chunk_words;
+
+        // And write those words to the FIFO
+        for (int i=0; i<chunk_words; ++i) output_word(m, chunk[i]);
     }
 
-    // Otherwise, the buffer isn't on a 32-bit boundary, so we have to do this the slow way
-    else while (word_count--)
+    // Keep track of how much we've written, and whether the FIFO overflowed
+    m.h2f_stats.words += words_written;
+    note_fifo_events(m.h2f_stats, m.p_ctrl_out);
+
+    // If we've written the entire message, another message may now be written
+    if (tx.is_done())
     {
-        // Pack the next 4 bytes of the input string into a 32-bit little-endian word
-        word >>= 8; word |= (*ptr++ << 24);
-        word >>= 8; word |= (*ptr++ << 24);
-        word >>= 8; word |= (*ptr++ << 24);
-        word >>= 8; word |= (*ptr++ << 24);
-
-        // And write that word to the FIFO
-        *m.p_data_out = word;
+        m.p_current_tx = nullptr;
+        ++m.h2f_stats.messages;
+    }
+
+    // Tell the caller how much progress we made
+    return words_written;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// cancel_send() - Abandons the message that's partially written to the output FIFO, if any
+//
+// The thread that was writing it finds out the next time it calls try_send().  Until then, we
+// only remember the address of its fifo_tx_t, so it's safe to cancel a message whose fifo_tx_t
+// no longer exists
+//=================================================================================================
+void CFpgaFifo::cancel_send()
+{
+    // Provide access to our private variables
+    access();
+
+    // Wait for any burst that's being written to finish
+    PSingleLock lock(&m.send_cs);
+
+    // If a message is partially written, forget it, so the next message can be written
+    if (m.p_current_tx)
+    {
+        printf("Abandoning a partially written FIFO message\n");
+        m.p_cancelled_tx = m.p_current_tx;
+        m.p_current_tx   = nullptr;
+    }
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// send_generic() - Sends any arbitrary message, waiting for room in the FIFO as needed
+//=================================================================================================
+void CFpgaFifo::send_generic(int message_type, int byte_count, const void* buffer)
+{
+    fifo_tx_t tx;
+
+    // Provide access to our private variables
+    access();
+
+    // Get ready to write this message to the FIFO
+    start_generic(tx, message_type, byte_count, buffer);
+
+    // This is how many times in a row we've found the FIFO full, and when we first found it full
+    int idle_count = 0;
+    u64 idle_start = 0;
+
+    // Write the message in bursts as the firmware makes room in the FIFO
+    while (!tx.is_done())
+    {
+        // If we wrote some words, go write some more
+        if (try_send(tx))
+        {
+            // If we had to wait for room, keep track of how long we waited
+            if (idle_count)
+            {
+                PSingleLock lock(&m.send_cs);
+                m.h2f_stats.wait_usec += hrclock_usec() - idle_start;
+            }
+            idle_count = 0;
+            continue;
+        }
+
+        // Keep track of when we started waiting for room
+        if (idle_count == 0) idle_start = hrclock_usec();
+
+        // The FIFO is full.  Spin for a bit, then start sleeping while the firmware drains it
+        if (++idle_count < 100)
+            cpu_relax();
+        else
+            usleep(50);
     }
 }
 //=================================================================================================
@@ -184,14 +681,181 @@ void CFpgaFifo::send_string(const char* ptr)
 
 //=================================================================================================
 // send_gxip() - Sends a GXIP message to the Nios-II
+//
+// Passed:  message = The GXIP message to send
+//          tag     = A sequence tag for the firmware to echo in its handshake and response, or 0
+//=================================================================================================
+void CFpgaFifo::send_gxip(gxip_packet_t& message, u16 tag)
+{
+    send_generic(FIFO_MSG_GXIP | (tag << FIFO_MSG_TAG_SHIFT), message.length(), &message);
+}
+//=================================================================================================
+
+
+
+
+//=================================================================================================
+// get_irq() - Returns the interrupt line we wait on, or nullptr if we're polling
+//=================================================================================================
+CUio* CFpgaFifo::get_irq()
+{
+    // Provide access to our private variables
+    access();
+
+    return m.use_irq ? &m.irq : nullptr;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// set_wait_policy() - Determines how wait_for_message() waits for messages to arrive
+//
+// Passed:  spin_usec        = The maximum time to busy-poll the FIFO before sleeping (0 = none)
+//          adaptive         = If true, the spin budget adapts to recent message latencies
+//          backoff_max_usec = The longest sleep between polls of the FIFO
+//
+// After spinning, we sleep for exponentially increasing periods until that period reaches
+// backoff_max_usec.  From then on we block on the FIFO interrupt (if we have one), or continue
+// polling every backoff_max_usec microseconds.
 //=================================================================================================
-void CFpgaFifo::send_gxip(gxip_packet_t& message)
+void CFpgaFifo::set_wait_policy(int spin_usec, bool adaptive, int backoff_max_usec)
 {
-    send_generic(FIFO_MSG_GXIP, message.length(), &message);
+    // Provide access to our private variables
+    access();
+
+    // Don't allow a back-off that's shorter than where back-off starts
+    if (backoff_max_usec < BACKOFF_START_USEC) backoff_max_usec = BACKOFF_START_USEC;
+
+    m.spin_max_usec    = spin_usec;
+    m.spin_min_usec    = spin_usec / 16;
+    m.spin_adaptive    = adaptive;
+    m.backoff_max_usec = backoff_max_usec;
+
+    // We start out spinning for as long as we're allowed to
+    m.spin_budget      = spin_usec;
+    m.avg_latency_usec = spin_usec / 2;
 }
 //=================================================================================================
 
 
+//=================================================================================================
+// set_message_deadline() - Sets how long read_message() will wait for the remainder of a message
+//                          after the firmware has started writing it
+//=================================================================================================
+void CFpgaFifo::set_message_deadline(int deadline_ms)
+{
+    // Provide access to our private variables
+    access();
+
+    m.msg_deadline_usec = deadline_ms * 1000;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// note_wait_latency() - Records how long a caller waited for a message, and if the spin budget
+//                       is adaptive, adjusts the spin budget for the next wait
+//=================================================================================================
+void CFpgaFifo::note_wait_latency(u32 latency_usec)
+{
+    // Provide access to our private variables
+    access();
+
+    // If the spin budget is fixed, there's nothing to do
+    if (!m.spin_adaptive || m.spin_max_usec == 0) return;
+
+    // Keep a moving average of latencies, weighting the newest latency at 1/4
+    m.avg_latency_usec = (m.avg_latency_usec * 3 + latency_usec) / 4;
+
+    // Spinning for twice the average latency catches most messages that arrive quickly
+    u32 budget = m.avg_latency_usec * 2;
+
+    // Don't spin for longer than we're allowed to
+    if (budget > m.spin_max_usec) budget = m.spin_max_usec;
+
+    // If messages typically take much longer than we're willing to spin, spinning just burns CPU
+    if (m.avg_latency_usec > 2 * m.spin_max_usec) budget = m.spin_min_usec;
+
+    // Never spin for less than the minimum
+    if (budget < m.spin_min_usec) budget = m.spin_min_usec;
+
+    // This is how long we'll spin on the next wait
+    m.spin_budget = budget;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// get_wait_stats() - Fetches the counters that describe how we've been waiting for messages
+//=================================================================================================
+void CFpgaFifo::get_wait_stats(fifo_wait_stats_t* p_stats)
+{
+    // Provide access to our private variables
+    access();
+
+    p_stats->waits       = m.waits;
+    p_stats->spin_hits   = m.spin_hits;
+    p_stats->sleep_hits  = m.sleep_hits;
+    p_stats->irq_hits    = m.irq_hits;
+    p_stats->timeouts    = m.timeouts;
+    p_stats->sleeps      = m.sleeps;
+    p_stats->spin_usec   = m.spin_usec;
+    p_stats->spin_budget = m.spin_budget;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// get_fifo_stats() - Fetches the throughput and health telemetry for both directions of the FIFO
+//
+// The F2H counters are updated by another thread while we copy them, so they may be very
+// slightly inconsistent with one another
+//=================================================================================================
+void CFpgaFifo::get_fifo_stats(fifo_stats_t* p_stats)
+{
+    // Provide access to our private variables
+    access();
+
+    // Copy the H2F stats while no other thread is updating them
+    m.send_cs.lock();
+    p_stats->h2f = m.h2f_stats;
+    m.send_cs.unlock();
+
+    // Copy the F2H stats
+    p_stats->f2h = m.f2h_stats;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// reset_stats() - Clears the wait statistics and the FIFO telemetry
+//
+// The F2H telemetry is cleared while another thread may be updating it, so a sample or two
+// recorded at the same moment may survive
+//=================================================================================================
+void CFpgaFifo::reset_stats()
+{
+    // Provide access to our private variables
+    access();
+
+    // Clear the wait statistics
+    m.waits      = 0;
+    m.spin_hits  = 0;
+    m.sleep_hits = 0;
+    m.irq_hits   = 0;
+    m.timeouts   = 0;
+    m.sleeps     = 0;
+    m.spin_usec  = 0;
+
+    // Clear the H2F telemetry while no other thread is updating it
+    m.send_cs.lock();
+    memset(&m.h2f_stats, 0, sizeof m.h2f_stats);
+    m.send_cs.unlock();
+
+    // Clear the F2H telemetry
+    memset(&m.f2h_stats, 0, sizeof m.f2h_stats);
+}
+//=================================================================================================
 
 
 //=================================================================================================
@@ -203,19 +867,21 @@ bool CFpgaFifo::is_message_waiting()
     access();
 
     // If we have more than two words in the FIFO, assume it has a message
-    return (m.p_ctrl_in->fill_level > 2);
+    return (input_level(m) > 2);
 }
 //=================================================================================================
 
 
 //=================================================================================================
 // wait_for_message() - Waits up to a specified number of milliseconds for a message to arrive
+//
+// We busy-poll for the current spin budget, then sleep for exponentially increasing periods,
+// then finally block on the FIFO interrupt (or keep polling, if there's no interrupt)
 //=================================================================================================
 bool CFpgaFifo::wait_for_message(int timeout_ms)
 {
-    // These define the unit of time in between checks for a waiting message
-    static const int time_unit_msec = 20;
-    static const int time_unit_usec = time_unit_msec * 1000;
+    // Provide access to our private variables
+    access();
 
     // Is there a message waiting right now?
     bool is_a_message_waiting = is_message_waiting();
@@ -223,72 +889,275 @@ bool CFpgaFifo::wait_for_message(int timeout_ms)
     // If we're not supposed to wait around, just tell the caller whether there's a message waiting
     if (timeout_ms == 0 || is_a_message_waiting) return is_a_message_waiting;
 
-    // Otherwise, start counting down
-    while (timeout_ms >= 0)
+    // Keep track of how many times we've had to wait
+    ++m.waits;
+
+    // Find out when we started waiting, and when we have to give up
+    u64 start    = hrclock_usec();
+    u64 deadline = start + (u64)timeout_ms * 1000;
+    u64 now      = start;
+
+    // Busy-poll the FIFO for the duration of our spin budget
+    u64 spin_end = start + m.spin_budget;
+    if (spin_end > deadline) spin_end = deadline;
+    while (now < spin_end)
     {
-        timeout_ms -= time_unit_msec;
-        usleep(time_unit_usec);
-        if (is_message_waiting()) return true;
+        if (is_message_waiting())
+        {
+            ++m.spin_hits;
+            m.spin_usec += now - start;
+            m.f2h_stats.wait_usec += now - start;
+            note_wait_latency(now - start);
+            return true;
+        }
+        cpu_relax();
+        now = hrclock_usec();
+    }
+    m.spin_usec += now - start;
+
+    // If we spun, back off gradually.  If not, we start out fully backed off, the way we always have
+    int sleep_usec = m.spin_max_usec ? BACKOFF_START_USEC : m.backoff_max_usec;
+
+    while (true)
+    {
+        // If we've run out of time, a message never arrived
+        now = hrclock_usec();
+        if (now >= deadline) break;
+
+        // Once we're fully backed off and the FIFO can interrupt us, sleep until it does
+        if (m.use_irq && sleep_usec >= m.backoff_max_usec)
+        {
+            if (!wait_for_interrupt((deadline - now + 999) / 1000)) break;
+            ++m.irq_hits;
+            now = hrclock_usec();
+            m.f2h_stats.wait_usec += now - start;
+            note_wait_latency(now - start);
+            return true;
+        }
+
+        // Sleep for a while, but not past our deadline
+        if (sleep_usec > deadline - now) sleep_usec = deadline - now;
+        usleep(sleep_usec);
+        ++m.sleeps;
+
+        // If a message arrived while we were sleeping, we're done
+        if (is_message_waiting())
+        {
+            ++m.sleep_hits;
+            now = hrclock_usec();
+            m.f2h_stats.wait_usec += now - start;
+            note_wait_latency(now - start);
+            return true;
+        }
+
+        // Sleep twice as long next time, up to our limit
+        sleep_usec *= 2;
+        if (sleep_usec > m.backoff_max_usec) sleep_usec = m.backoff_max_usec;
     }
 
     // If we get here, a message never arrived
+    ++m.timeouts;
+    m.f2h_stats.wait_usec += hrclock_usec() - start;
     return false;
 }
 //=================================================================================================
 
 
+//=================================================================================================
+// wait_for_interrupt() - Waits up to a specified number of milliseconds for the input FIFO to
+//                        interrupt us, signaling that a message has arrived
+//=================================================================================================
+bool CFpgaFifo::wait_for_interrupt(int timeout_ms)
+{
+    // Provide access to our private variables
+    access();
+
+    // Find out when we have to give up waiting
+    u64 deadline = hrclock_usec() + (u64)timeout_ms * 1000;
+
+    while (true)
+    {
+        // Clear the "almost full" event, then unmask the interrupt
+        m.p_ctrl_in->event = ALTERA_FIFO_CSR_ALMOSTFULL;
+        m.irq.enable();
+
+        // If a message arrived before we armed the interrupt, we're done
+        if (is_message_waiting()) return true;
+
+        // How many milliseconds until our deadline? (rounded up)
+        u64 now = hrclock_usec();
+        if (now >= deadline) return false;
+        int remaining_ms = (deadline - now + 999) / 1000;
+
+        // Sleep until the FIFO interrupts us or we time out
+        if (!m.irq.wait(remaining_ms)) return is_message_waiting();
+
+        // The interrupt fired.  If there's a whole message header in the FIFO, we're done
+        if (is_message_waiting()) return true;
+    }
+}
+//=================================================================================================
+
+
 //=================================================================================================
 // read_message() - Reads a message from the incoming FIFO
 //
-// Returns:  true if there was a message read, otherwise false
+// Returns:  A slot containing the message, or nullptr if there was no message (or if every slot
+//           is still in use).  The caller must pass the slot to release() when done with it.
 //
-// On Exit:  If there was a message waiting:
-//              class variable msg_length = The number of 32 bit words in the payload
-//              class variable msg_type   = Which kind of message (string, or GX command?)
-//              class variable payload    = The message payload
+// On Exit:  If there was a message waiting, the returned slot contains:
+//              length  = The number of 32 bit words in the payload
+//              type    = Which kind of message (string, or GX command?)
+//              tag     = The sequence tag the firmware echoed, or 0
+//              payload = The message payload
 //=================================================================================================
-bool CFpgaFifo::read_message(int timeout_ms)
+fifo_msg_t* CFpgaFifo::read_message(int timeout_ms)
 {
+    // Provide access to our private variables
+    access();
+
+    // Find a free slot, starting with the one after the last slot we filled
+    fifo_msg_t* msg = nullptr;
+    for (int i=0; i<FIFO_MSG_SLOTS; ++i)
+    {
+        fifo_msg_t* slot = &m.slots[(m.next_slot + i) % FIFO_MSG_SLOTS];
+        if (!slot->in_use.load(std::memory_order_acquire))
+        {
+            msg = slot;
+            m.next_slot = (m.next_slot + i + 1) % FIFO_MSG_SLOTS;
+            break;
+        }
+    }
+
+    // If every slot is in use, leave the message in the FIFO until one is released
+    if (msg == nullptr) return nullptr;
+
+    // If the last message stalled, throw away what's arrived of the rest of it
+    skip_stalled_words(m);
 
     // If there's no message waiting in the pipe, we're done
-    if (!wait_for_message(timeout_ms)) return false;
+    if (!wait_for_message(timeout_ms)) return nullptr;
 
-    // Provide access to our private variables
-    access();
+    // Some of what just arrived may be the rest of the stalled message.  What follows it might not
+    // be a whole message header yet
+    if (!skip_stalled_words(m) || !is_message_waiting()) return nullptr;
+
+    // Keep track of when this message arrived
+    msg->arrival_usec = hrclock_usec();
+
+    // Find out how full the input FIFO is as we start reading the message
+    note_fill_level(m.f2h_stats, input_level(m));
 
-    // Fetch the message type
-    msg_type = *m.p_data_in;
+    // Fetch the message type and the sequence tag that shares its word
+    u32 type_word = input_word(m);
+    msg->type = type_word & FIFO_MSG_TYPE_MASK;
+    msg->tag  = type_word >> FIFO_MSG_TAG_SHIFT;
 
     // Fetch the number of 32-bit words in the payload
-    msg_length = *m.p_data_in;
+    msg->length = input_word(m);
 
-    // We don't yet know how many words are in the FIFO
-    int words_in_pipe = 0;
+    // If the header makes no sense, we've lost our place in the stream.  Nothing in the FIFO can
+    // be trusted, so throw it all away and start over with whatever the firmware sends next
+    if (msg->type > FIFO_MSG_GXIP || (u32)msg->length > FIFO_MAX_MSG_WORDS)
+    {
+        printf("FIFO message header (type %i, %u words) is invalid; resyncing\n", msg->type, (u32)msg->length);
+        m.f2h_stats.words += 2;
+        drain_input(m);
+        ++m.f2h_stats.resyncs;
+        return nullptr;
+    }
 
     // This is the number of 32-bit words we're going to read from the FIFO
-    int i = msg_length;
+    int remaining = msg->length;
+
+    // This is how many of those words will fit into the payload buffer
+    int room = sizeof(msg->payload) / 4;
 
     // Get a point to the payload area as though it were 32-bit words
-    int32_t* out = (int32_t*)payload;
+    uint32_t* out = (uint32_t*)msg->payload;
+
+    // We'll set a deadline for the rest of the message the first time we find the FIFO empty
+    u64 deadline = 0;
 
     // So long as we have words left to read in our message
-    while (i--)
+    while (remaining)
     {
-        // Wait for there to be words in the pipe available for reading
-        while (words_in_pipe == 0)
+        // Find out how many words are in the FIFO right now
+        int burst = input_level(m);
+
+        // If the FIFO is empty, wait for the firmware to write more, but not forever
+        if (burst == 0)
         {
-            words_in_pipe = m.p_ctrl_in->fill_level;
+            u64 now = hrclock_usec();
+            if (deadline == 0) deadline = now + m.msg_deadline_usec;
+            if (now >= deadline)
+            {
+                // Throw away the rest of this message when it arrives, rather than mistake it
+                // for the header of the next one
+                printf("FIFO stalled with %i of %i words unread\n", remaining, msg->length);
+                m.f2h_stats.words += 2 + msg->length - remaining;
+                m.f2h_skip_words = remaining;
+                ++m.f2h_stats.resyncs;
+                return nullptr;
+            }
+            cpu_relax();
+            continue;
         }
 
-        // Read this word from the FIFO and put it in the payload buffer
-        *out++ = *m.p_data_in;
+        // Don't read past the end of this message
+        if (burst > remaining) burst = remaining;
+        remaining -= burst;
+
+        // Read as much of this burst as will fit into the payload buffer
+        int count = (burst < room) ? burst : room;
+        read_burst(m, out, count);
+        out  += count;
+        room -= count;
 
-        // And now we have one fewer words in the FIFO
-        words_in_pipe--;
+        // Anything that didn't fit gets thrown away
+        for (count = burst - count; count; --count) input_word(m);
     }
 
+    // Keep track of how much we've read, and whether the FIFO overflowed or underflowed
+    m.f2h_stats.words += 2 + msg->length;
+    ++m.f2h_stats.messages;
+    note_fifo_events(m.f2h_stats, m.p_ctrl_in);
+
+    // This slot belongs to the caller until they release it
+    msg->in_use.store(true, std::memory_order_release);
+
     // Tell the caller that they have a message waiting
-    return true;
+    return msg;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// has_free_slot() - Returns true if read_message() has a free slot to read a message into
+//=================================================================================================
+bool CFpgaFifo::has_free_slot()
+{
+    // Provide access to our private variables
+    access();
+
+    // Look for a slot that isn't in use
+    for (int i=0; i<FIFO_MSG_SLOTS; ++i)
+    {
+        if (!m.slots[i].in_use.load(std::memory_order_acquire)) return true;
+    }
+
+    // If we get here, every slot is in use
+    return false;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// release() - Returns a slot from read_message() to the ring so it can be filled again
+//=================================================================================================
+void CFpgaFifo::release(fifo_msg_t* msg)
+{
+    if (msg) msg->in_use.store(false, std::memory_order_release);
 }
 //=================================================================================================
 
@@ -2,9 +2,143 @@
 // fpga_fifo.h - Defines a bidirectional 32-bit wide FIFO to the NIOS-II core
 //=================================================================================================
 #pragma once
+#include <atomic>
 #include "memmap.h"
 #include "gxip_struct.h"
 
+class CUio;
+
+//=================================================================================================
+// Counters that describe how CFpgaFifo has been waiting for incoming messages
+//=================================================================================================
+struct fifo_wait_stats_t
+{
+    u32     waits;          // Number of times a caller had to wait for a message
+    u32     spin_hits;      // ... of those, how many times a message arrived while spinning
+    u32     sleep_hits;     // ... of those, how many times a message arrived while backing off
+    u32     irq_hits;       // ... of those, how many times the FIFO interrupt woke us
+    u32     timeouts;       // ... of those, how many times no message arrived
+    u32     sleeps;         // Number of back-off sleeps
+    u64     spin_usec;      // Total time spent spinning, in microseconds
+    u32     spin_budget;    // How long we'll spin on the next wait, in microseconds
+};
+//=================================================================================================
+
+
+//=================================================================================================
+// The fill-level histograms have a bucket for an empty FIFO, then one bucket per power of two:
+// 1, 2-3, 4-7, ... and finally 256 or more
+//=================================================================================================
+#define FIFO_FILL_BUCKETS   10
+//=================================================================================================
+
+
+//=================================================================================================
+// Telemetry for one direction of the FIFO.  The fill level is sampled once per message, as we
+// start writing it to (or reading it from) the FIFO.
+//=================================================================================================
+struct fifo_dir_stats_t
+{
+    u64     words;                          // Number of 32-bit words transferred, including headers
+    u32     messages;                       // Number of complete messages transferred
+    u32     level;                          // The most recently sampled fill level
+    u32     high_water;                     // The highest fill level we've seen
+    u32     overflows;                      // Number of times the FIFO reported an overflow
+    u32     underflows;                     // Number of times the FIFO reported an underflow
+    u64     wait_usec;                      // Time spent waiting for space (H2F) or data (F2H)
+    u32     fill_hist[FIFO_FILL_BUCKETS];   // How often we've seen each range of fill levels
+    u32     resyncs;                        // Times we lost our place in the stream of messages
+};
+
+struct fifo_stats_t
+{
+    fifo_dir_stats_t h2f;                   // The FIFO from us to the firmware
+    fifo_dir_stats_t f2h;                   // The FIFO from the firmware to us
+};
+//=================================================================================================
+
+
+//=================================================================================================
+// Keeps track of a message that is being written to the output FIFO one burst at a time.
+//
+// Once try_send() has written part of a message, CFpgaFifo remembers where its fifo_tx_t is until
+// the message is finished, so the fifo_tx_t (and the message) must outlive the write.  A caller
+// that gives up on a partially written message must call cancel_send() first.
+//=================================================================================================
+struct fifo_tx_t
+{
+    const unsigned char* ptr;   // The next byte of the message body to be written
+    u32     header[2];          // The message type and the number of 32-bit words in the body
+    int     words_total;        // The number of 32-bit words to write, including the header
+    int     words_sent;         // The number of 32-bit words written so far
+    bool    is_cancelled;       // True if cancel_send() abandoned the message before it was done
+
+    bool    is_done() {return words_sent == words_total;}
+};
+//=================================================================================================
+
+
+//=================================================================================================
+// These are the types of messages we can send on the FIFO
+//=================================================================================================
+enum
+{
+    FIFO_MSG_STRING = 0,
+    FIFO_MSG_GXIP   = 1
+};
+
+// The upper 16 bits of the message-type word may carry a sequence tag that the firmware echoes
+// back in its handshake and response.  A tag of 0 means "untagged"
+#define FIFO_MSG_TYPE_MASK  0xFFFF
+#define FIFO_MSG_TAG_SHIFT  16
+//=================================================================================================
+
+
+//=================================================================================================
+// This is the number of messages from the firmware that can be held at once
+//=================================================================================================
+#define FIFO_MSG_SLOTS  16
+//=================================================================================================
+
+
+//=================================================================================================
+// No message from the firmware is longer than this many 32-bit words, which is about twice the
+// size of the largest GXIP packet.  A message header that claims otherwise means we've lost our
+// place in the stream of words from the firmware
+//=================================================================================================
+#define FIFO_MAX_MSG_WORDS  1024
+//=================================================================================================
+
+
+//=================================================================================================
+// fifo_msg_t - A slot in the ring of messages received from the firmware.  Each slot is large
+//              enough for a complete GXIP packet, and starts on its own cache line
+//=================================================================================================
+struct alignas(64) fifo_msg_t
+{
+    // Which kind of message this is (string, or GX command?)
+    int     type;
+
+    // The sequence tag the firmware attached to this message, or 0 if it's untagged
+    u16     tag;
+
+    // The number of 32-bit words in the payload
+    int     length;
+
+    // This is true from the time read_message() fills in this slot until it is released
+    std::atomic<bool> in_use;
+
+    // The time (from hrclock_usec) at which the message was found in the FIFO
+    u64     arrival_usec;
+
+    // The message payload, rounded up to a whole number of 32-bit words
+    alignas(4) u8 payload[(sizeof(gxip_packet_t) + 3) & ~3];
+
+    // Returns the payload as a GXIP packet
+    gxip_packet_t& gxip() {return *(gxip_packet_t*)payload;}
+};
+//=================================================================================================
+
 
 class CFpgaFifo
 {
@@ -17,31 +151,75 @@ public:
     // Pass an already open CMemMap object
     bool    init(CMemMap& mm);
 
+    // Wait for incoming messages via interrupts on a UIO device instead of by polling
+    bool    enable_interrupts(const char* uio_device);
+
+    // Returns the interrupt line we wait on for incoming messages, or nullptr if we're polling
+    CUio*   get_irq();
+
+    // Determines how long to spin, back-off and then block while waiting for a message
+    void    set_wait_policy(int spin_usec, bool adaptive, int backoff_max_usec);
+
+    // Sets how long read_message() waits for the rest of a message that has started to arrive
+    void    set_message_deadline(int deadline_ms);
+
+    // Fetches the counters that describe how we've been waiting for messages
+    void    get_wait_stats(fifo_wait_stats_t* p_stats);
+
+    // Fetches the throughput and health telemetry for both directions of the FIFO
+    void    get_fifo_stats(fifo_stats_t* p_stats);
+
+    // Clears the wait statistics and the FIFO telemetry
+    void    reset_stats();
+
     // Call this to send a character string to the Nios-II
     void    send_string(const char* ptr);
 
-    // Call this to send a GXIP message to the Nios-II
-    void    send_gxip(gxip_packet_t& message);
+    // Call this to send a GXIP message to the Nios-II, optionally with a sequence tag
+    void    send_gxip(gxip_packet_t& message, u16 tag = 0);
+
+    // Prepares a GXIP message to be sent by try_send()
+    void    start_gxip(fifo_tx_t& tx, gxip_packet_t& message, u16 tag = 0);
+
+    // Writes as much of a message as fits in the output FIFO without waiting.  Returns # of words
+    int     try_send(fifo_tx_t& tx);
+
+    // Abandons the message that's partially written to the output FIFO, if there is one, so that
+    // other messages may be written.  Call this when the firmware is reset
+    void    cancel_send();
+
+    // Tells us how many 32-bit words the output FIFO can hold
+    void    set_output_depth(int depth);
 
     // Call this to determine whether there is an incoming message waiting
     bool    is_message_waiting();
 
-    // Reads a message from the FIFO and fills in msg_length, msg_type, and payload
-    bool    read_message(int timeout_ms = 0);
+    // Reads a message from the FIFO into a free slot and returns it (or nullptr if no message)
+    fifo_msg_t* read_message(int timeout_ms = 0);
 
-    // These are all filled in after a successful call to "read_message"
-    int     msg_length;
-    int     msg_type;
-    char    payload[1024];
+    // Returns true if read_message() has a free slot to read a message into
+    bool    has_free_slot();
+
+    // Call this when you're done with a message returned by read_message()
+    void    release(fifo_msg_t* msg);
 
 protected:
 
     // Sends a message of an arbitrary type
     void    send_generic(int type, int byte_count, const void* buffer);
 
+    // Prepares a message of an arbitrary type to be sent by try_send()
+    void    start_generic(fifo_tx_t& tx, int type, int byte_count, const void* buffer);
+
     // This waits for a message to arrive, with a timeout
     bool    wait_for_message(int timeout_ms);
 
+    // This waits for the input FIFO to interrupt us, with a timeout
+    bool    wait_for_interrupt(int timeout_ms);
+
+    // Records how long a caller waited for a message and adapts the spin budget
+    void    note_wait_latency(u32 latency_usec);
+
     // Our private variables
     void*   m_pv;
 
@@ -0,0 +1,336 @@
+//=================================================================================================
+// fw_model.cpp - Implements a thread that plays the part of the FPGA and Nios-II firmware when
+//                the register window is emulated
+//=================================================================================================
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include "fw_model.h"
+#include "fpga_fifo.h"
+#include "sopcinfo.h"
+#include "pio_monitor.h"
+#include "common.h"
+#include "hrclock.h"
+
+
+//=================================================================================================
+// The unsolicited events that the model sends are GXIP commands with this ID
+//=================================================================================================
+#define EMU_EVENT_ID    0xEE
+//=================================================================================================
+
+//=================================================================================================
+// Constructor() - Starts out with default timing and nothing attached
+//=================================================================================================
+CFwModel::CFwModel()
+{
+    m_h2f     = nullptr;
+    m_f2h     = nullptr;
+    m_f2h_csr = nullptr;
+    m_reset   = nullptr;
+    m_irq     = nullptr;
+    m_status_pio = nullptr;
+    m_status_irq = nullptr;
+
+    // By default, the "firmware" never speaks unless spoken to
+    m_event_ms    = 0;
+    m_next_event  = 0;
+    m_event_count = 0;
+
+    // By default, the "firmware" handshakes in 100us and responds in 1ms
+    set_timing(100, 1000);
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// init() - Finds the emulated FIFOs and PIO in the register window
+//=================================================================================================
+bool CFwModel::init(CMemMap& mm)
+{
+    // The firmware model only makes sense with an emulated register window
+    if (!mm.is_emulated()) return false;
+
+    // The emulated FIFOs live at the addresses of the FIFO data ports
+    m_h2f = (emu_fifo_t*)mm[H2F_FIFO_DATA];
+    m_f2h = (emu_fifo_t*)mm[F2H_FIFO_DATA];
+
+    // These are ordinary registers, and can be read and written directly
+    m_f2h_csr = (altera_fifo_csr_t*)mm[F2H_FIFO_CSR];
+    m_reset   = &((pio_t*)mm[NIOS_RESET_PIO])->data;
+
+    // Tell the caller that all is well
+    return true;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// set_timing() - Sets how long the "firmware" takes to send a handshake and a response
+//=================================================================================================
+void CFwModel::set_timing(int hsk_usec, int rsp_usec)
+{
+    m_hsk_usec = hsk_usec;
+    m_rsp_usec = rsp_usec;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// set_status_pio() - Attaches the firmware status PIO and asserts our "alive" line
+//=================================================================================================
+void CFwModel::set_status_pio(pio_t* pio, CUio* irq)
+{
+    m_status_pio = pio;
+    m_status_irq = irq;
+    set_status_line(PIO_ALIVE_SHIFT, true);
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// set_status_line() - Drives our "alive" or "busy" line on the firmware status PIO
+//
+// Passed:  shift = PIO_ALIVE_SHIFT or PIO_BUSY_SHIFT
+//          state = true to assert the line, false to deassert it
+//=================================================================================================
+void CFwModel::set_status_line(int shift, bool state)
+{
+    // If there's no status PIO, there's nothing to drive
+    if (m_status_pio == nullptr) return;
+
+    // Our line is the one for the slot our module appears in
+    u32 bit  = (1 << ASSUMED_SLOT) << shift;
+    u32 data = m_status_pio->data;
+
+    // If the line is already in that state, there's no edge
+    if (((data & bit) != 0) == state) return;
+
+    // Drive the line and capture the edge
+    m_status_pio->data  = state ? (data | bit) : (data & ~bit);
+    m_status_pio->edge |= bit;
+
+    // If the host has enabled the interrupt for this line, interrupt it
+    if ((m_status_pio->intmask & bit) && m_status_irq) m_status_irq->raise();
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// is_in_reset() - Returns 'true' if the NIOS_RESET PIO is holding the Nios-II in reset
+//=================================================================================================
+bool CFwModel::is_in_reset()
+{
+    return (*m_reset & 1) != 0;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// read_message() - Reads one message from the H2F FIFO
+//
+// Returns:  true if a message was read, false if there isn't one or the Nios-II is in reset
+//
+// On Exit:  m_msg_type, m_msg_length and m_message contain the message
+//=================================================================================================
+bool CFwModel::read_message()
+{
+    // If there's no message header in the FIFO, there's no message
+    if (m_h2f->level() < 2) return false;
+
+    // Fetch the message type (and sequence tag) and the number of 32-bit words that follow
+    u32 type_word = m_h2f->pop();
+    m_msg_type   = type_word & FIFO_MSG_TYPE_MASK;
+    m_msg_tag    = type_word >> FIFO_MSG_TAG_SHIFT;
+    m_msg_length = m_h2f->pop();
+
+    // Read the rest of the message as it arrives
+    for (int i=0; i<m_msg_length; ++i)
+    {
+        // Wait for the next word to arrive
+        while (m_h2f->level() == 0)
+        {
+            if (is_in_reset()) return false;
+            usleep(10);
+        }
+
+        // Fetch the word, throwing away anything that won't fit
+        u32 word = m_h2f->pop();
+        if (i < EMU_FIFO_DEPTH) m_message[i] = word;
+    }
+
+    // Tell the caller that we have a message
+    return true;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// write_message() - Writes a message to the F2H FIFO
+//=================================================================================================
+void CFwModel::write_message(int type, int byte_count, const void* buffer)
+{
+    u32 word;
+
+    // How many 32-bit words will this message occupy?
+    int word_count = (byte_count + 3) / 4;
+
+    // Wait for there to be room in the FIFO for the entire message
+    while (m_f2h->space() < word_count + 2) usleep(10);
+
+    // Write the message header
+    m_f2h->push(type);
+    m_f2h->push(word_count);
+
+    // Write the message body, a 32-bit word at a time
+    const u8* ptr = (const u8*)buffer;
+    for (int i=0; i<word_count; ++i)
+    {
+        word = 0;
+        memcpy(&word, ptr, (byte_count < 4) ? byte_count : 4);
+        m_f2h->push(word);
+        ptr += 4;
+        byte_count -= 4;
+    }
+
+    // Get a convenient reference to the F2H FIFO control/status register
+    volatile altera_fifo_csr_t& csr = *m_f2h_csr;
+
+    // The emulated FIFO can neither overflow nor underflow.  But this register isn't really
+    // write-1-to-clear, so a host clearing those events looks like it set them.  Throw them away
+    if (csr.event & (ALTERA_FIFO_CSR_OVERFLOW | ALTERA_FIFO_CSR_UNDERFLOW))
+    {
+        csr.event &= ~(ALTERA_FIFO_CSR_OVERFLOW | ALTERA_FIFO_CSR_UNDERFLOW);
+    }
+
+    // If the host has enabled the "almost full" interrupt and the threshold has been reached,
+    // record the event and interrupt the host
+    if ((csr.interuptenable & ALTERA_FIFO_CSR_ALMOSTFULL) && m_f2h->level() >= csr.almostfull)
+    {
+        csr.event |= ALTERA_FIFO_CSR_ALMOSTFULL;
+        if (m_irq) m_irq->raise();
+    }
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// reply() - Sends a GXIP packet back to the host, echoing the sequence tag of the message that
+//           we're replying to
+//=================================================================================================
+void CFwModel::reply(gxip_packet_t& packet)
+{
+    write_message(FIFO_MSG_GXIP | (m_msg_tag << FIFO_MSG_TAG_SHIFT), packet.length(), &packet);
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// handle_gxip() - Responds to a GXIP message from the host the way the firmware would
+//=================================================================================================
+void CFwModel::handle_gxip(gxip_packet_t& packet)
+{
+    static gxip_packet_t response;
+
+    // We only respond to commands and requests
+    if (!packet.is_cmd() && !packet.is_req()) return;
+
+    // After a while, acknowledge the message
+    usleep(m_hsk_usec);
+    static u8 handshake[4] = {0, 4, HSK_PKT, 'A'};
+    reply(*(gxip_packet_t*)handshake);
+
+    // Commands don't get a response
+    if (packet.is_cmd()) return;
+
+    // We're busy while we work on the response
+    set_status_line(PIO_BUSY_SHIFT, true);
+
+    // After a while longer, respond to the request.  The response echoes the request's payload
+    usleep(m_rsp_usec);
+    int length = packet.length();
+    memcpy(&response, &packet, length);
+    response.type = (packet.type == REQ_E_PKT) ? RSP_E_PKT : RSP_PKT;
+    set_status_line(PIO_BUSY_SHIFT, false);
+    reply(response);
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// send_event() - Sends an unsolicited event to the host, if it's time to.  The event is a GXIP
+//                command whose payload is the event ID and a 32-bit count of events sent
+//=================================================================================================
+void CFwModel::send_event()
+{
+    // If we don't send events, or it isn't time for the next one, there's nothing to do
+    if (m_event_ms == 0) return;
+    u64 now = hrclock_usec();
+    if (now < m_next_event) return;
+
+    // Schedule the event after this one
+    m_next_event = now + m_event_ms * 1000ull;
+
+    // Build the event
+    u8 event[8] = {0, 8, CMD_PKT, EMU_EVENT_ID};
+    event[4] = m_event_count >> 24;
+    event[5] = m_event_count >> 16;
+    event[6] = m_event_count >>  8;
+    event[7] = m_event_count;
+    ++m_event_count;
+
+    // And send it, untagged, because it doesn't answer anything
+    write_message(FIFO_MSG_GXIP, sizeof event, event);
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// main() - When this thread spawns, execution starts here
+//=================================================================================================
+void CFwModel::main(void* p1, void* p2, void* p3)
+{
+    // Map a GXIP packet over the message we receive from the host
+    gxip_packet_t& packet = *(gxip_packet_t*)m_message;
+
+    while (true)
+    {
+        // While the Nios-II is in reset, it doesn't read the FIFO or send anything, and it
+        // isn't alive
+        if (is_in_reset())
+        {
+            set_status_line(PIO_ALIVE_SHIFT, false);
+            set_status_line(PIO_BUSY_SHIFT,  false);
+            m_h2f->flush();
+            usleep(1000);
+            continue;
+        }
+
+        // If we're running, we're alive
+        set_status_line(PIO_ALIVE_SHIFT, true);
+
+        // Tell the host about anything that happened on its own
+        send_event();
+
+        // If there's no message from the host, check again in a moment
+        if (!read_message())
+        {
+            usleep(10);
+            continue;
+        }
+
+        // The firmware prints string messages from the host to its console
+        if (m_msg_type == FIFO_MSG_STRING)
+        {
+            printf("FW model: %s\n", (char*)m_message);
+            continue;
+        }
+
+        // Ignore a GXIP message that's too short to contain a GXIP header
+        if (m_msg_type != FIFO_MSG_GXIP || m_msg_length == 0) continue;
+
+        // Handle the GXIP message
+        handle_gxip(packet);
+    }
+}
+//=================================================================================================
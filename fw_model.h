@@ -0,0 +1,102 @@
+//=================================================================================================
+// fw_model.h - Defines a thread that plays the part of the FPGA and Nios-II firmware when the
+//              register window is emulated
+//=================================================================================================
+#pragma once
+#include "cthread.h"
+#include "memmap.h"
+#include "gxip_struct.h"
+#include "emu_fifo.h"
+#include "uio.h"
+#include "altera_peripherals.h"
+
+//=================================================================================================
+// CFwModel - Emulates the H2F/F2H FIFOs and the NIOS_RESET PIO, and answers GXIP commands and
+//            requests the way the firmware would: a handshake for every command or request, and
+//            a response for every request
+//=================================================================================================
+class CFwModel : public CThread
+{
+public:
+
+    // Constructor
+    CFwModel();
+
+    // When this thread spawns, the entry point is here
+    void    main(void* p1, void* p2, void* p3);
+
+    // Pass an emulated CMemMap object
+    bool    init(CMemMap& mm);
+
+    // Sets how long the "firmware" takes to send a handshake and a response, in microseconds
+    void    set_timing(int hsk_usec, int rsp_usec);
+
+    // Sets how often (in milliseconds) the "firmware" sends an unsolicited event.  0 = never
+    void    set_event_period(int period_ms) {m_event_ms = period_ms;}
+
+    // If the FIFO is waiting on a simulated interrupt line, pass it here
+    void    set_irq(CUio* irq) {m_irq = irq;}
+
+    // If there's a firmware status PIO, pass it here along with its (simulated) interrupt line.
+    // The model asserts its "alive" line, and asserts "busy" while it's working on a request
+    void    set_status_pio(pio_t* pio, CUio* irq);
+
+protected:
+
+    // Reads one message from the H2F FIFO into m_message
+    bool    read_message();
+
+    // Writes a message to the F2H FIFO and interrupts the host if it's asked us to
+    void    write_message(int type, int byte_count, const void* buffer);
+
+    // Sends a GXIP packet back to the host
+    void    reply(gxip_packet_t& packet);
+
+    // Handles a GXIP message from the host
+    void    handle_gxip(gxip_packet_t& packet);
+
+    // Returns 'true' if the NIOS_RESET PIO is holding the Nios-II in reset
+    bool    is_in_reset();
+
+    // Drives our "alive" or "busy" line on the firmware status PIO
+    void    set_status_line(int shift, bool state);
+
+    // Sends an unsolicited event to the host, if it's time to
+    void    send_event();
+
+    // The FIFO that the host writes to, and the one that we write to
+    emu_fifo_t*         m_h2f;
+    emu_fifo_t*         m_f2h;
+
+    // The control/status register of the F2H FIFO
+    volatile altera_fifo_csr_t* m_f2h_csr;
+
+    // The NIOS_RESET PIO data register
+    volatile u32*       m_reset;
+
+    // If the host is waiting on a simulated interrupt, this is it
+    CUio*               m_irq;
+
+    // The firmware status PIO and its interrupt line, or nullptr if there isn't one
+    volatile pio_t*     m_status_pio;
+    CUio*               m_status_irq;
+
+    // How long it takes us to send a handshake and a response, in microseconds
+    int                 m_hsk_usec, m_rsp_usec;
+
+    // How often we send an unsolicited event (in milliseconds), when the next one is due (from
+    // hrclock_usec), and how many we've sent
+    int                 m_event_ms;
+    u64                 m_next_event;
+    u32                 m_event_count;
+
+    // The message type and length (in 32-bit words) of the message in m_message
+    int                 m_msg_type, m_msg_length;
+
+    // The sequence tag of the message in m_message, which we echo back in our replies
+    u16                 m_msg_tag;
+
+    // The most recent message we read from the H2F FIFO
+    u32                 m_message[EMU_FIFO_DEPTH];
+};
+//=================================================================================================
@@ -2,25 +2,25 @@
 // fwlistener.cpp- Implements a thread that listens for messages from the firmware
 //=================================================================================================
 #include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <stdint.h>
+#include <string.h>
 #include "fwlistener.h"
 #include "globals.h"
-
-#define FWL_HSK         0x01
-#define FWL_RSP         0x02
-#define FWL_DISCARD_HSK 0x80
-
-
-// Map a GXIP packet onto the messages that will be received by the CommFifo
-gxip_packet_t& response = *(gxip_packet_t*) CommFifo.payload;
+#include "common.h"
+#include "hrclock.h"
 
 
 //=================================================================================================
-// This is how long (in milliseconds) we'll wait around for handshake from the firmware
+// This is the longest (in milliseconds) we'll wait around for handshake from the firmware.  It's
+// also how long we wait until we've learned how quickly a message is usually handshaked
 //=================================================================================================
 #define GXPPP_HSK_TIMEOUT 5000
 
 //=================================================================================================
-// This is how long (in milliseconds) we'll wait around for response message from the firmware
+// This is the longest (in milliseconds) we'll wait around for response message from the firmware.
+// It's also how long we wait until we've learned how quickly a request usually gets a response
 //=================================================================================================
 #define GXPPP_RSP_TIMEOUT 15000
 
@@ -28,42 +28,64 @@ gxip_packet_t& response = *(gxip_packet_t*) CommFifo.payload;
 //=================================================================================================
 // is_firmware_busy() - Return 'true' if the firmware has asserted its "busy" signal
 //=================================================================================================
-static bool is_firmware_busy() {return false;}
+static bool is_firmware_busy() {return (PioMonitor.busy_sites() >> ASSUMED_SLOT) & 1;}
 //=================================================================================================
 
 
 //=================================================================================================
-// send_nak_handshake_to_host() - Sends a NAK GXIP handshake back to the client
+// is_firmware_alive() - Return 'true' if the firmware has asserted its "alive" signal
+//=================================================================================================
+static bool is_firmware_alive() {return (PioMonitor.live_sites() >> ASSUMED_SLOT) & 1;}
+//=================================================================================================
+
+
 //=================================================================================================
-void send_nak_handshake_to_host()
+// send_nak_handshake_to_host() - Sends a NAK GXIP handshake back to the client on a connection
+//=================================================================================================
+void send_nak_handshake_to_host(conn_ref_t origin)
 {
     // Build a GXIP 'NAK" handshake
     static u8 handshake[4] = {0, 4, HSK_PKT, 'N'};
 
     // And send it back to the host
-    MainServer.send_gxip_to_host(*(gxip_packet_t*)handshake);
+    origin.send_gxip_to_host(*(gxip_packet_t*)handshake);
 }
 //=================================================================================================
 
 
 //=================================================================================================
-// send_busy_handshake_to_host() - Sends a BUSY GXIP handshake back to the client
+// send_ack_handshake_to_host() - Sends an ACK GXIP handshake back to the client on a connection
 //=================================================================================================
-void send_busy_handshake_to_host()
+void send_ack_handshake_to_host(conn_ref_t origin)
+{
+    // Build a GXIP "ACK" handshake
+    static u8 handshake[4] = {0, 4, HSK_PKT, 'A'};
+
+    // And send it back to the host
+    origin.send_gxip_to_host(*(gxip_packet_t*)handshake);
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// send_busy_handshake_to_host() - Sends a BUSY GXIP handshake back to the client on a connection
+//=================================================================================================
+void send_busy_handshake_to_host(conn_ref_t origin)
 {
     // Build a GXIP "Busy" handshake
     static u8 handshake[4] = {0, 4, HSK_PKT, 'B'};
 
     // And send it back to the host
-    MainServer.send_gxip_to_host(*(gxip_packet_t*)handshake);
+    origin.send_gxip_to_host(*(gxip_packet_t*)handshake);
 }
 //=================================================================================================
 
 
 //=================================================================================================
-// send_mrm_to_host() - Sends a "missing response message" packet to the host in lieu of a response
+// send_mrm_to_host() - Sends a "missing response message" packet to the host on a connection, in
+//                      lieu of a response
 //=================================================================================================
-void send_mrm_to_host(int msg_type, int msg_id)
+void send_mrm_to_host(conn_ref_t origin, int msg_type, int msg_id)
 {
     // This will serve as a GXIP "Missing Response Message"
     u8 buffer[5];
@@ -82,7 +104,45 @@ void send_mrm_to_host(int msg_type, int msg_id)
     buffer[4] = msg_type;
 
     // And send it back to the host
-    MainServer.send_gxip_to_host(*(gxip_packet_t*)buffer);
+    origin.send_gxip_to_host(*(gxip_packet_t*)buffer);
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// These are the things handle_timeouts() can decide to tell the host
+//=================================================================================================
+enum
+{
+    FWL_SEND_NAK,
+    FWL_SEND_BUSY,
+    FWL_SEND_MRM
+};
+//=================================================================================================
+
+
+//=================================================================================================
+// is_older() - Returns 'true' if transaction "a" was sent to the firmware before transaction "b"
+//=================================================================================================
+static bool is_older(fwl_txn_t* a, fwl_txn_t* b)
+{
+    // Sequence numbers wrap, so compare them by the sign of their difference
+    return (s32)(a->seq - b->seq) < 0;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// is_response_to() - Returns 'true' if a response packet has the type and ID that answers the
+//                    request of a transaction
+//=================================================================================================
+static bool is_response_to(gxip_packet_t& response, fwl_txn_t* txn)
+{
+    // An extended response answers an extended request, and a plain response a plain request
+    bool types_match = (response.type == RSP_E_PKT) == (txn->type == REQ_E_PKT);
+
+    // And the response carries the ID of the request it answers
+    return types_match && response.id() == txn->id;
 }
 //=================================================================================================
 
@@ -92,139 +152,1024 @@ void send_mrm_to_host(int msg_type, int msg_id)
 //=================================================================================================
 CFWListener::CFWListener()
 {
-    // We're not currently active
-    m_is_active = false;
+    // The transaction table starts out empty
+    memset(m_txn, 0, sizeof m_txn);
+    m_outstanding = 0;
+    m_next_seq    = 0;
+    m_next_tag    = 1;
 
-    // And create the command pipe
-    pipe(m_pipe);
+    // We're not writing a message to the FIFO
+    m_is_sending    = false;
+
+    // Until we're told otherwise, every message has normal priority
+    m_ext_priority  = FWL_PRIO_NORMAL;
+    memset(m_class_stats, 0, sizeof m_class_stats);
+    memset(&m_match_stats, 0, sizeof m_match_stats);
+    m_rsp_timed_out = false;
+    m_hsk_timed_out = false;
+
+    // By default, time out at 4 times the 99th percentile latency, once we have 20 samples
+    set_timeout_policy(99, 4, 100, 20);
+
+    // By default, one transaction at a time, untagged, with a few messages allowed to wait and
+    // no coalescing.  These match the defaults in configure_listener()
+    m_window      = 1;
+    m_use_tags    = false;
+    m_queue_depth = 16;
+    m_coalesce    = false;
+
+    // Create the doorbell that transact() uses to wake us.  We clear it without blocking
+    m_doorbell    = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    m_is_sleeping = false;
 }
 //=================================================================================================
 
 
+//=================================================================================================
+// configure() - Sets how many transactions may be outstanding at once, whether messages to
+//               the firmware carry a sequence tag, and how many messages may wait to be sent
+//
+// Passed:  window      = The number of transactions that may be outstanding (1 thru FWL_MAX_TXNS)
+//          use_tags    = If true, the firmware echoes a sequence tag in its handshakes and responses
+//          queue_depth = The number of messages of each priority that may wait for room in the
+//                        window (1 thru FWL_MAX_PENDING)
+//          coalesce    = If true, a request that's byte-for-byte identical to one that's already
+//                        outstanding shares that transaction instead of starting its own.
+//                        Requests with a cacheable ID (RSP_CACHE_TTLS) are coalesced either way
+//
+// Without tags, handshakes are matched to transactions in the order the messages were sent,
+// and responses are matched by message type and ID.
+//=================================================================================================
+void CFWListener::configure(int window, bool use_tags, int queue_depth, bool coalesce)
+{
+    // Keep the window within the size of our transaction table
+    if (window < 1) window = 1;
+    if (window > FWL_MAX_TXNS) window = FWL_MAX_TXNS;
+
+    // Keep the queue depth within the size of the queue
+    if (queue_depth < 1) queue_depth = 1;
+    if (queue_depth > FWL_MAX_PENDING) queue_depth = FWL_MAX_PENDING;
+
+    // Don't change the queue depth while a message is being queued
+    m_producer_cs.lock();
+    m_queue_depth = queue_depth;
+    m_producer_cs.unlock();
 
+    // Don't change the rules while a transaction is in progress
+    PSingleLock lock(&m_table_cs);
+    m_window   = window;
+    m_use_tags = use_tags;
+    m_coalesce = coalesce;
+}
 //=================================================================================================
-// main() - When this thread spawns, execution starts here
+
+
 //=================================================================================================
-void CFWListener::main(void* p1, void* p2, void* p3)
+// set_timeout_policy() - Sets how handshake and response timeouts are derived from the latencies
+//                        we've seen for each message type and ID
+//
+// Passed:  percentile  = Which percentile of the latency to base the timeout on
+//          factor      = The timeout is that percentile times this safety factor
+//          min_ms      = The shortest timeout we'll ever use
+//          min_samples = Until we've seen this many latencies, we use the fixed GXPPP timeouts
+//
+// Timeouts never exceed the fixed GXPPP timeouts
+//=================================================================================================
+void CFWListener::set_timeout_policy(int percentile, int factor, int min_ms, int min_samples)
 {
-    char    cmd;
+    // Keep the percentile sensible, and the factor and minimums positive
+    if (percentile < 1  ) percentile  = 1;
+    if (percentile > 100) percentile  = 100;
+    if (factor      < 1 ) factor      = 1;
+    if (min_ms      < 1 ) min_ms      = 1;
+    if (min_samples < 1 ) min_samples = 1;
 
-again:
+    PSingleLock lock(&m_table_cs);
+    m_timeout_pct         = percentile;
+    m_timeout_factor      = factor;
+    m_timeout_min_ms      = min_ms;
+    m_timeout_min_samples = min_samples;
+}
+//=================================================================================================
 
-    // We're not currently waiting for a message from the GX
-    m_is_active = false;
 
-    // Wait for a message to arrive on our command pipe
-    while (read(m_pipe[0], &cmd, 1) != 1);
+//=================================================================================================
+// set_timeout_override() - Sets a fixed handshake or response timeout for a message ID
+//=================================================================================================
+void CFWListener::set_timeout_override(bool is_rsp, int id, int timeout_ms)
+{
+    PSingleLock lock(&m_table_cs);
+    if (is_rsp)
+        m_rsp_override[id] = timeout_ms;
+    else
+        m_hsk_override[id] = timeout_ms;
+}
+//=================================================================================================
+
 
-    // We're waiting for a response message from the GX
-    m_is_active = true;
+//=================================================================================================
+// latency_of() - Returns the latency histograms for a message type and ID
+//
+// On Entry: The caller holds m_table_cs
+//=================================================================================================
+fwl_latency_t& CFWListener::latency_of(gxip_type_t type, u16 id)
+{
+    return m_latency[(type << 16) | id];
+}
+//=================================================================================================
 
-    // If we're supposed to discard the ACK from the firmware, set the flag accordingly
-    bool discard_handshake = (cmd & FWL_DISCARD_HSK) != 0;
 
-    // If we should be waiting for a handshake from the firmware...
-    while (cmd & FWL_HSK)
+//=================================================================================================
+// timeout_ms() - Returns how long to wait for a transaction's handshake or response
+//
+// On Entry: The caller holds m_table_cs
+//=================================================================================================
+int CFWListener::timeout_ms(fwl_txn_t* txn, bool is_rsp)
+{
+    // If the config file has a fixed timeout for this message ID, use it
+    std::map<int, int>& overrides = is_rsp ? m_rsp_override : m_hsk_override;
+    auto it = overrides.find(txn->id);
+    if (it != overrides.end()) return it->second;
+
+    // This is the longest we'll ever wait
+    int limit = is_rsp ? GXPPP_RSP_TIMEOUT : GXPPP_HSK_TIMEOUT;
+
+    // Find the latencies we've seen for this type and ID
+    fwl_latency_t& latency = latency_of(txn->type, txn->id);
+    CLatencyHist&  hist    = is_rsp ? latency.rsp : latency.hsk;
+
+    // Until we've seen enough of them, wait as long as we ever would
+    if (hist.count() < m_timeout_min_samples) return limit;
+
+    // Wait for the chosen percentile latency, times the safety factor (rounded up to milliseconds)
+    u64 timeout = ((u64)hist.percentile(m_timeout_pct) * m_timeout_factor + 999) / 1000;
+
+    // And keep that within our limits
+    if (timeout < m_timeout_min_ms) timeout = m_timeout_min_ms;
+    if (timeout > limit) timeout = limit;
+    return timeout;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// get_latency_stats() - Fetches summaries of the latency histograms
+//
+// Passed:  first     = The index of the first (type, ID) to summarize
+//          out       = Where to store the summaries
+//          max_count = The largest number of summaries to store
+//          p_total   = Where to store the number of (type, ID)s we have latencies for
+//
+// Returns: The number of summaries stored.  (type, ID)s are in order of type, then ID
+//=================================================================================================
+int CFWListener::get_latency_stats(int first, fwl_latency_summary_t* out, int max_count, int* p_total)
+{
+    int count = 0, index = 0;
+
+    // Lock the latencies while we look at them
+    PSingleLock lock(&m_table_cs);
+
+    // Tell the caller how many (type, ID)s there are
+    *p_total = m_latency.size();
+
+    // Summarize each (type, ID) that the caller asked for
+    for (auto& it : m_latency)
     {
-        // Wait for messages from the firmware to arrive...
-        while (!CommFifo.read_message(GXPPP_HSK_TIMEOUT))
+        // Skip over the ones before the first one the caller wants, and stop when we're full
+        if (index++ < first) continue;
+        if (count == max_count) break;
+
+        // Fill in the type and ID
+        fwl_latency_summary_t& summary = out[count++];
+        summary.type = (gxip_type_t)(it.first >> 16);
+        summary.id   = it.first & 0xFFFF;
+
+        // Summarize each phase
+        CLatencyHist* phase[FWL_PHASES] = {&it.second.send, &it.second.hsk, &it.second.rsp, &it.second.reply};
+        for (int i=0; i<FWL_PHASES; ++i)
         {
-            // If we didn't receive a handshake message from the firmware because it's busy,
-            // send a "busy" handshake to the host, and keep waiting for a handshake
-            if (is_firmware_busy())
-            {
-                send_busy_handshake_to_host();
-                continue;
-            }
+            summary.phase[i].count = phase[i]->count();
+            summary.phase[i].p50   = phase[i]->percentile(50);
+            summary.phase[i].p90   = phase[i]->percentile(90);
+            summary.phase[i].p99   = phase[i]->percentile(99);
+            summary.phase[i].max   = phase[i]->max();
+        }
+    }
+
+    // Tell the caller how many summaries we stored
+    return count;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// reset_latency_stats() - Throws away all the latencies we've recorded.  Until new latencies
+//                         accumulate, timeouts revert to the fixed GXPPP timeouts
+//=================================================================================================
+void CFWListener::reset_latency_stats()
+{
+    PSingleLock lock(&m_table_cs);
+    m_latency.clear();
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// set_priority() - Sets the priority (FWL_PRIO_xxx) of messages with a particular ID
+//=================================================================================================
+void CFWListener::set_priority(int id, int priority)
+{
+    if (priority < 0 || priority >= FWL_PRIORITIES) return;
+    PSingleLock lock(&m_producer_cs);
+    m_priority[id] = priority;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// set_ext_priority() - Sets the priority (FWL_PRIO_xxx) of CMD_E and REQ_E messages whose ID
+//                      doesn't have a priority of its own
+//=================================================================================================
+void CFWListener::set_ext_priority(int priority)
+{
+    if (priority < 0 || priority >= FWL_PRIORITIES) return;
+    PSingleLock lock(&m_producer_cs);
+    m_ext_priority = priority;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// get_priority_stats() - Fetches the counts of messages waiting at each priority
+//
+// Passed:  out = An array of FWL_PRIORITIES entries to fill in
+//=================================================================================================
+void CFWListener::get_priority_stats(fwl_class_stats_t* out)
+{
+    // We need both locks to get a consistent picture
+    PSingleLock lock1(&m_producer_cs);
+    PSingleLock lock2(&m_table_cs);
+
+    // Hand the caller the counts, and how deep each queue is right now
+    for (int i=0; i<FWL_PRIORITIES; ++i)
+    {
+        out[i] = m_class_stats[i];
+        out[i].depth = m_pending[i].size();
+    }
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// reset_priority_stats() - Clears the counts of messages waiting at each priority
+//=================================================================================================
+void CFWListener::reset_priority_stats()
+{
+    PSingleLock lock1(&m_producer_cs);
+    PSingleLock lock2(&m_table_cs);
+    memset(m_class_stats, 0, sizeof m_class_stats);
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// get_match_stats() - Fetches the counts of handshakes and responses that matched no transaction
+//=================================================================================================
+void CFWListener::get_match_stats(fwl_match_stats_t* p_stats)
+{
+    PSingleLock lock(&m_table_cs);
+    *p_stats = m_match_stats;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// reset_match_stats() - Clears the counts of handshakes and responses that matched no transaction
+//=================================================================================================
+void CFWListener::reset_match_stats()
+{
+    PSingleLock lock(&m_table_cs);
+    memset(&m_match_stats, 0, sizeof m_match_stats);
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// finish() - Frees an entry in the transaction table
+//
+// On Entry: The caller holds m_table_cs
+//=================================================================================================
+void CFWListener::finish(fwl_txn_t* txn)
+{
+    txn->in_use = false;
+    --m_outstanding;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// handle_handshake() - Matches a handshake from the firmware to an outstanding transaction and
+//                      sends it to the host
+//=================================================================================================
+void CFWListener::handle_handshake(fifo_msg_t* msg)
+{
+    fwl_txn_t* match = nullptr;
+    conn_ref_t origin[FWL_MAX_WAITERS];
+    int        count = 0;
+
+    // Lock the transaction table while we examine it
+    m_table_cs.lock();
+
+    // A tagged handshake belongs to the transaction with that tag.  Otherwise the firmware
+    // handshakes messages in the order it receives them, so it belongs to the oldest transaction
+    for (int i=0; i<FWL_MAX_TXNS; ++i)
+    {
+        fwl_txn_t* txn = &m_txn[i];
+        if (!txn->in_use || !txn->wants_hsk) continue;
+        if (msg->tag)
+        {
+            if (txn->tag == msg->tag) {match = txn; break;}
+        }
+        else if (match == nullptr || is_older(txn, match)) match = txn;
+    }
+
+    // If an untagged handshake timed out, the firmware may still send it, and it would look just
+    // like the handshake for the next transaction.  No new transaction starts until that late
+    // handshake arrives (or it's too late to arrive), so the first untagged handshake after a
+    // timeout is the late one.  Once it's here, the firmware is back in step with us
+    if (msg->tag == 0 && m_hsk_timed_out)
+    {
+        m_hsk_timed_out = false;
+        match = nullptr;
+    }
+
+    // If this handshake doesn't belong to any transaction, it's stale.  Throw it away
+    if (match == nullptr)
+    {
+        ++m_match_stats.stale_hsks;
+        m_table_cs.unlock();
+        CommFifo.release(msg);
+        return;
+    }
+
+    // Find out which connections this handshake goes to.  Every request that was coalesced
+    // into this transaction gets a copy
+    for (int i=0; i<match->waiters; ++i) if (match->waiter[i].wants_hsk)
+    {
+        origin[count++] = match->waiter[i].origin;
+        match->waiter[i].wants_hsk = false;
+    }
+
+    // Keep track of how long the firmware took to handshake
+    u64 now = hrclock_usec();
+    latency_of(match->type, match->id).hsk.record(now - match->start);
+
+    // We have our handshake.  If there's a response coming, start waiting for it
+    match->wants_hsk = false;
+    if (match->wants_rsp)
+    {
+        match->start    = now;
+        match->deadline = now + (u64)timeout_ms(match, true) * 1000;
+    }
+    else
+        finish(match);
+
+    // We're done with the transaction table
+    m_table_cs.unlock();
+
+    // Pass this ACK on to each connection that's owed it
+    for (int i=0; i<count; ++i) origin[i].send_gxip_to_host(msg->gxip());
+
+    // And we're done with this message
+    CommFifo.release(msg);
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// handle_response() - Matches a response from the firmware to an outstanding transaction and
+//                     sends it to the host
+//=================================================================================================
+void CFWListener::handle_response(fifo_msg_t* msg)
+{
+    fwl_txn_t* match  = nullptr;
+    fwl_txn_t* oldest = nullptr;
+    conn_ref_t origin[FWL_MAX_WAITERS];
+
+    // Map a GXIP packet onto the response we received from the firmware
+    gxip_packet_t& response = msg->gxip();
 
-            // Otherwise, tell the host that firmware never acknowledged the receipt of the message
-            send_nak_handshake_to_host();
-            return;
+    // Lock the transaction table while we examine it
+    m_table_cs.lock();
+
+    // A tagged response belongs to the transaction with that tag.  Otherwise it belongs to the
+    // oldest request with the same type and ID
+    for (int i=0; i<FWL_MAX_TXNS; ++i)
+    {
+        fwl_txn_t* txn = &m_txn[i];
+        if (!txn->in_use || !txn->wants_rsp) continue;
+        if (msg->tag)
+        {
+            if (txn->tag == msg->tag) {match = txn; break;}
+            continue;
+        }
+        if (oldest == nullptr || is_older(txn, oldest)) oldest = txn;
+        if (is_response_to(response, txn) && (match == nullptr || is_older(txn, match))) match = txn;
+    }
+
+    // A response that matched by tag, or by type and ID, certainly answers its request
+    bool is_certain = (match != nullptr);
+
+    // If nothing matches the response's type and ID, and only one transaction may be outstanding,
+    // give it to that one.  This is exactly how we've always behaved.  With a wider window, an
+    // untagged response that doesn't match could belong to any of them, so it belongs to none.
+    // And if a request has timed out since the last response, it could be that request's late
+    // response
+    if (match == nullptr && m_window == 1 && !m_rsp_timed_out) match = oldest;
+
+    // Whatever this response is, it's the one that followed any request that timed out
+    m_rsp_timed_out = false;
+
+    // If this response doesn't belong to any transaction, it's stale.  Throw it away
+    if (match == nullptr)
+    {
+        ++m_match_stats.stale_rsps;
+        m_table_cs.unlock();
+        CommFifo.release(msg);
+        return;
+    }
+
+    // Keep track of how long the firmware took to respond
+    latency_of(match->type, match->id).rsp.record(hrclock_usec() - match->start);
+
+    // Keep the type and ID, the transaction is about to be freed
+    gxip_type_t type = match->type;
+    u16         id   = match->id;
+
+    // Find out which connections the response goes to.  Every request that was coalesced into
+    // this transaction gets a copy
+    int count = match->waiters;
+    for (int i=0; i<count; ++i) origin[i] = match->waiter[i].origin;
+
+    // If the response is to be cached, keep the request it answers too.  A response that we only
+    // guess belongs to this request is never cached, since every later caller would get it
+    std::string cache_key;
+    if (match->is_cacheable && is_certain) cache_key.swap(m_request[match - m_txn]);
+
+    // This transaction is complete
+    finish(match);
+
+    // We're done with the transaction table
+    m_table_cs.unlock();
+
+    // Send the response to each connection that asked for it
+    for (int i=0; i<count; ++i) origin[i].send_gxip_to_host(response);
+
+    // Keep the response around for the next time the host asks the same thing
+    if (!cache_key.empty()) ResponseCache.store(cache_key, response);
+
+    // Keep track of how long it took to get the response to the host
+    m_table_cs.lock();
+    latency_of(type, id).reply.record(hrclock_usec() - msg->arrival_usec);
+    m_table_cs.unlock();
+
+    // And we're done with this message
+    CommFifo.release(msg);
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// handle_timeouts() - Handles every transaction whose handshake or response is overdue
+//=================================================================================================
+void CFWListener::handle_timeouts()
+{
+    struct {int what; gxip_type_t type; u16 id; int count; conn_ref_t origin[FWL_MAX_WAITERS];} action[FWL_MAX_TXNS];
+    int action_count = 0;
+
+    // Lock the transaction table while we examine it
+    m_table_cs.lock();
+
+    // Find out what time it is
+    u64 now = hrclock_usec();
+
+    // Look at each outstanding transaction whose deadline has passed
+    for (int i=0; i<FWL_MAX_TXNS; ++i)
+    {
+        fwl_txn_t* txn = &m_txn[i];
+        if (!txn->in_use || txn->deadline > now) continue;
+
+        // Fill in the type and ID of the message that timed out, and who to tell.  Every request
+        // that was coalesced into this transaction hears about it too
+        action[action_count].type  = txn->type;
+        action[action_count].id    = txn->id;
+        action[action_count].count = txn->waiters;
+        for (int j=0; j<txn->waiters; ++j) action[action_count].origin[j] = txn->waiter[j].origin;
+
+        // If the firmware is busy, tell the host and keep waiting
+        if (is_firmware_busy())
+        {
+            action[action_count++].what = FWL_SEND_BUSY;
+            txn->deadline = now + (u64)timeout_ms(txn, !txn->wants_hsk) * 1000;
+            continue;
+        }
+
+        // Count the time we waited as a latency.  If the firmware has slowed down, this raises
+        // the next timeout, so that we don't keep timing out at the old, faster rate
+        fwl_latency_t& latency = latency_of(txn->type, txn->id);
+        (txn->wants_hsk ? latency.hsk : latency.rsp).record(now - txn->start);
+
+        // If the firmware never acknowledged the message, the host gets a NAK.  If it never
+        // responded, the host gets an MRM (Missing Response Message) in lieu of a response
+        action[action_count++].what = txn->wants_hsk ? FWL_SEND_NAK : FWL_SEND_MRM;
+
+        // If the firmware answers a request after all, its response will arrive late
+        if (txn->wants_rsp) m_rsp_timed_out = true;
+
+        // Likewise an untagged handshake.  Give it as long to show up as we'd ever wait for one
+        if (txn->wants_hsk && txn->tag == 0)
+        {
+            int grace_ms = timeout_ms(txn, false);
+            if (grace_ms < GXPPP_HSK_TIMEOUT) grace_ms = GXPPP_HSK_TIMEOUT;
+            m_hsk_timed_out   = true;
+            m_hsk_resync_time = now + (u64)grace_ms * 1000;
+        }
+
+        // Either way, this transaction is over
+        finish(txn);
+    }
+
+    // We're done with the transaction table
+    m_table_cs.unlock();
+
+    // And tell each connection what happened
+    for (int i=0; i<action_count; ++i) for (int j=0; j<action[i].count; ++j)
+    {
+        conn_ref_t origin = action[i].origin[j];
+        switch (action[i].what)
+        {
+            case FWL_SEND_NAK:
+                send_nak_handshake_to_host(origin);
+                break;
+
+            case FWL_SEND_BUSY:
+                send_busy_handshake_to_host(origin);
+                break;
+
+            case FWL_SEND_MRM:
+                send_mrm_to_host(origin, action[i].type, action[i].id);
+                break;
+        }
+    }
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// ms_until_next_deadline() - Returns the number of milliseconds (rounded up) until the earliest
+//                            deadline in the transaction table, or -1 if there are none
+//=================================================================================================
+int CFWListener::ms_until_next_deadline()
+{
+    u64 earliest = 0;
+
+    // Find the earliest deadline
+    PSingleLock lock(&m_table_cs);
+    for (int i=0; i<FWL_MAX_TXNS; ++i)
+    {
+        if (!m_txn[i].in_use) continue;
+        if (earliest == 0 || m_txn[i].deadline < earliest) earliest = m_txn[i].deadline;
+    }
+
+    // If we're waiting for a late handshake, we stop waiting at m_hsk_resync_time
+    if (m_hsk_timed_out && (earliest == 0 || m_hsk_resync_time < earliest)) earliest = m_hsk_resync_time;
+
+    // If there are no outstanding transactions, there's nothing to time out
+    if (earliest == 0) return -1;
+
+    // Tell the caller how long until then
+    u64 now = hrclock_usec();
+    return (earliest > now) ? (earliest - now + 999) / 1000 : 0;
+}
+//=================================================================================================
+
+
+
+//=================================================================================================
+// start_transaction() - Enters a message into the transaction table, just before it's written to
+//                       the FIFO, so the listener is ready for the firmware's handshake
+//
+// On Exit: m_tx is ready to write the message to the FIFO
+//=================================================================================================
+void CFWListener::start_transaction(fwl_pending_t& pending, int priority)
+{
+    fwl_txn_t*     txn = nullptr;
+    gxip_packet_t& message = pending.packet;
+
+    // Lock the transaction table
+    PSingleLock lock(&m_table_cs);
+
+    // The message has waited as long as it's going to
+    note_wait(priority, pending);
+
+    // Find a free entry in the table.  The caller has checked that there's room in the window
+    for (int i=0; i<FWL_MAX_TXNS; ++i) if (!m_txn[i].in_use)
+    {
+        txn = &m_txn[i];
+        break;
+    }
+
+    // Describe this transaction
+    txn->in_use      = true;
+    txn->wants_hsk   = true;
+    txn->wants_rsp   = message.is_req();
+    txn->is_cacheable = ResponseCache.is_cacheable(message);
+    txn->type        = message.type;
+    txn->id          = message.id();
+    txn->seq         = m_next_seq++;
+    txn->tag         = 0;
+    txn->queued      = pending.queued_usec;
+    txn->start       = hrclock_usec();
+    txn->deadline    = txn->start + (u64)timeout_ms(txn, false) * 1000;
+
+    // The handshake and response go back to the connection that sent the message, if any
+    txn->waiters = 0;
+    if (pending.origin)
+    {
+        txn->waiter[0].origin    = pending.origin;
+        txn->waiter[0].wants_hsk = true;
+        txn->waiters = 1;
+    }
+
+    // If the response is going to be cached, or identical requests may share this transaction,
+    // remember the request.  Otherwise make sure no stale request is matched against it
+    if (txn->is_cacheable || (m_coalesce && message.is_req()))
+        m_request[txn - m_txn] = CResponseCache::key_of(message);
+    else
+        m_request[txn - m_txn].clear();
+
+    // If we're tagging messages, give this one the next tag.  Zero means "untagged"
+    if (m_use_tags)
+    {
+        txn->tag = m_next_tag++;
+        if (m_next_tag == 0) m_next_tag = 1;
+    }
+
+    // There's one more transaction outstanding
+    ++m_outstanding;
+
+    // Get ready to write the message to the FIFO
+    CommFifo.start_gxip(m_tx, message, txn->tag);
+    m_tx_txn = txn;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// priority_of() - Returns the priority that a message should be sent at
+//
+// On Entry: The caller holds m_producer_cs
+//=================================================================================================
+int CFWListener::priority_of(gxip_packet_t& message)
+{
+    // If this message ID has a priority of its own, that's the one
+    auto it = m_priority.find(message.id());
+    if (it != m_priority.end()) return it->second;
+
+    // Otherwise, extended messages have their own priority, and all others are normal
+    return message.is_ext() ? m_ext_priority : FWL_PRIO_NORMAL;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// next_pending() - Returns the message that should be sent next, which is the oldest message
+//                  of the most urgent priority that has any waiting
+//
+// Passed:  p_priority = Receives the priority of that message
+//
+// Returns: The message, or nullptr if there are none waiting
+//=================================================================================================
+fwl_pending_t* CFWListener::next_pending(int* p_priority)
+{
+    for (int i=0; i<FWL_PRIORITIES; ++i)
+    {
+        fwl_pending_t* pending = m_pending[i].peek();
+        if (pending)
+        {
+            *p_priority = i;
+            return pending;
         }
+    }
+
+    // Nothing is waiting
+    return nullptr;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// can_start() - Returns 'true' if another transaction may start: there's room in the transaction
+//               window, and we're not waiting for a late untagged handshake
+//=================================================================================================
+bool CFWListener::can_start()
+{
+    PSingleLock lock(&m_table_cs);
+
+    // If the late handshake hasn't arrived by now, the firmware isn't going to send it
+    if (m_hsk_timed_out && hrclock_usec() >= m_hsk_resync_time) m_hsk_timed_out = false;
+
+    return m_outstanding < m_window && !m_hsk_timed_out;
+}
+//=================================================================================================
+
 
-        // Ignore any message that's not a handshake packet
-        if (response.type != HSK_PKT) continue;
+//=================================================================================================
+// has_pending() - Returns 'true' if any message is waiting to be sent
+//=================================================================================================
+bool CFWListener::has_pending()
+{
+    for (int i=0; i<FWL_PRIORITIES; ++i) if (!m_pending[i].empty()) return true;
+    return false;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// note_wait() - Counts how long a message waited before it left the queue
+//
+// On Entry: The caller holds m_table_cs
+//=================================================================================================
+void CFWListener::note_wait(int priority, fwl_pending_t& pending)
+{
+    fwl_class_stats_t& stats = m_class_stats[priority];
+    u32 wait_usec = hrclock_usec() - pending.queued_usec;
+    ++stats.dispatched;
+    stats.wait_usec += wait_usec;
+    if (wait_usec > stats.max_wait_usec) stats.max_wait_usec = wait_usec;
+}
+//=================================================================================================
 
-        // If we're supposed to pass this ACK on to the host, do so
-        if (!discard_handshake) MainServer.send_gxip_to_host(response);
 
-        // We're done waiting for a handshake message
+//=================================================================================================
+// coalesce() - Attaches a request to an outstanding transaction for a byte-for-byte identical
+//              request, so that the firmware's one handshake and response answer both
+//
+// Returns: true if the request was attached, false if it needs a transaction of its own
+//=================================================================================================
+bool CFWListener::coalesce(fwl_pending_t& pending, int priority)
+{
+    fwl_txn_t* match = nullptr;
+
+    // Only requests are coalesced, and only if we've been told to coalesce everything or the
+    // request's ID is cacheable.  A cacheable ID is one we've been told is safe to answer twice
+    gxip_packet_t& message = pending.packet;
+    if (!message.is_req()) return false;
+    if (!m_coalesce && !ResponseCache.is_cacheable(message)) return false;
+
+    // Lock the transaction table while we examine it
+    m_table_cs.lock();
+
+    // Look for an identical request that's still waiting for its response, and that has room
+    // for another waiter
+    int length = message.length();
+    for (int i=0; i<FWL_MAX_TXNS; ++i)
+    {
+        fwl_txn_t* txn = &m_txn[i];
+        if (!txn->in_use || !txn->wants_rsp || txn->waiters == FWL_MAX_WAITERS) continue;
+        std::string& request = m_request[i];
+        if ((int)request.size() != length || memcmp(request.data(), &message, length)) continue;
+        match = txn;
         break;
     }
 
+    // If there isn't one, the request needs a transaction of its own
+    if (match == nullptr)
+    {
+        m_table_cs.unlock();
+        return false;
+    }
+
+    // This request has waited as long as it's going to
+    note_wait(priority, pending);
 
-    // If we should be waiting for a response message from the firmware...
-    while (cmd & FWL_RSP)
+    // The request's connection is owed the response, and the handshake if it hasn't arrived yet.
+    // A request that didn't come from a connection is owed nothing
+    conn_ref_t origin = pending.origin;
+    if (origin)
     {
-        while (!CommFifo.read_message(GXPPP_RSP_TIMEOUT))
+        fwl_waiter_t& waiter = match->waiter[match->waiters++];
+        waiter.origin    = origin;
+        waiter.wants_hsk = match->wants_hsk;
+    }
+
+    // If the handshake has already arrived, the connection gets a copy right now
+    bool send_hsk_now = origin && !match->wants_hsk;
+
+    // We're done with the transaction table
+    m_table_cs.unlock();
+
+    // The firmware already acknowledged the identical request
+    if (send_hsk_now) send_ack_handshake_to_host(origin);
+
+    // Tell the caller that the request was coalesced
+    return true;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// dispatch_pending() - Writes queued messages to the FIFO for as long as there's room in the
+//                      transaction window and in the FIFO
+//
+// Returns: false if a message is only partially written because the FIFO is full
+//=================================================================================================
+bool CFWListener::dispatch_pending()
+{
+    while (true)
+    {
+        // If we're not in the middle of writing a message, start writing the next one
+        if (!m_is_sending)
         {
-            // If we didn't receive a handshake message from the firmware because it's busy,
-            // send a "busy" handshake to the host, and keep waiting for a handshake
-            if (is_firmware_busy())
+            // If nothing is waiting to be sent, we're done
+            int priority;
+            fwl_pending_t* pending = next_pending(&priority);
+            if (pending == nullptr) return true;
+
+            // If an identical request is already outstanding, this one rides along with it.
+            // That doesn't need room in the window
+            if (coalesce(*pending, priority))
             {
-                send_busy_handshake_to_host();
+                m_pending[priority].discard();
                 continue;
             }
 
-            // The firmware failed to send an expected response.  In lieu of a response,
-            // send the client an MRM (Missing Response Message)
-            send_mrm_to_host(m_outgoing_msg_type, m_outgoing_msg_id);
-            break;
+            // If the window is full, or we're waiting for a late handshake, the message will have
+            // to wait
+            if (!can_start()) return true;
+
+            // Enter the message at the front of the queue into the transaction table.  It stays
+            // in the queue (so transact() won't overwrite it) until it's completely written
+            start_transaction(*pending, priority);
+            m_tx_priority = priority;
+            m_is_sending  = true;
         }
 
-        // If this isn't a response message, ignore it
-        if (!response.is_rsp()) continue;
+        // Write as much of the message as the FIFO has room for
+        CommFifo.try_send(m_tx);
 
-        // We got a response from the firmware.  Send it to the host
-        MainServer.send_gxip_to_host(response);
+        // If the FIFO is full, we'll try again shortly
+        if (!m_tx.is_done()) return false;
 
-        // We're done waiting for a response message
-        break;
+        // The firmware has the whole message.  Keep track of how long that took, and start
+        // timing the handshake from now (unless the transaction timed out while we were writing).
+        // If the firmware was reset part way thru, it never got the message, and the transaction
+        // is left to time out
+        m_table_cs.lock();
+        if (m_tx_txn->in_use && !m_tx.is_cancelled)
+        {
+            u64 now = hrclock_usec();
+            latency_of(m_tx_txn->type, m_tx_txn->id).send.record(now - m_tx_txn->queued);
+            m_tx_txn->start    = now;
+            m_tx_txn->deadline = now + (u64)timeout_ms(m_tx_txn, false) * 1000;
+        }
+        m_table_cs.unlock();
+
+        // The message is written, so remove it from its queue
+        m_pending[m_tx_priority].discard();
+        m_is_sending = false;
     }
+}
+//=================================================================================================
 
 
-    // And go wait to be told to start listening for another message from the firmware
-    goto again;
+//=================================================================================================
+// main() - When this thread spawns, execution starts here
+//=================================================================================================
+void CFWListener::main(void* p1, void* p2, void* p3)
+{
+    eventfd_t   count;
+    fifo_msg_t* msg;
+    fifo_msg_t* hsk;
+
+    // We wake up when transact() pokes us, or when a handshake or a response arrives
+    pollfd fds[3] =
+    {
+        {m_doorbell,                    POLLIN, 0},
+        {FifoDemux.handshakes.get_fd(), POLLIN, 0},
+        {FifoDemux.responses.get_fd(),  POLLIN, 0}
+    };
+
+    // This is false while a message is stuck in a full FIFO
+    bool is_sent = true;
+
+    while (true)
+    {
+        // Sleep until something happens, or until the next transaction times out.  If a message
+        // is waiting for room in the FIFO, check back in a millisecond
+        int timeout_ms = ms_until_next_deadline();
+        if (!is_sent && (timeout_ms < 0 || timeout_ms > 1)) timeout_ms = 1;
+
+        // Tell transact() that it has to ring the doorbell.  If a message was queued before it
+        // could see that, and there's room in the window for it, don't go to sleep at all.  A
+        // message that's partly written is still queued, but it's waiting on the FIFO, not on us
+        m_is_sleeping = true;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (is_sent && !m_is_sending && has_pending() && can_start()) timeout_ms = 0;
+        poll(fds, 3, timeout_ms);
+        m_is_sleeping = false;
+
+        // Clear the doorbell that transact() uses to wake us
+        eventfd_read(m_doorbell, &count);
+
+        // Match each handshake to its transaction
+        while ((msg = FifoDemux.handshakes.try_pop())) handle_handshake(msg);
+
+        // Match each response to its transaction.  The firmware sends a handshake before the
+        // response, so handle any handshake that arrived while we weren't looking first
+        while ((msg = FifoDemux.responses.try_pop()))
+        {
+            while ((hsk = FifoDemux.handshakes.try_pop())) handle_handshake(hsk);
+            handle_response(msg);
+        }
+
+        // Deal with any transactions that the firmware hasn't answered in time
+        handle_timeouts();
+
+        // Send the firmware as many queued messages as the window allows
+        is_sent = dispatch_pending();
+    }
 }
 //=================================================================================================
 
 
 
 //=================================================================================================
-// transact() - Begins a transaction with the GX firmware.
+// transact() - Queues a message for the GX firmware, to begin a transaction once there's room in
+//              the transaction window
 //
 // A transaction consists of:
 //
 //  (1) Message send to the firmware
 //  (2) Firmware sends a handshake
 //  (3) Firmware optionally sends a response
+//
+// Passed:  message = The message for the firmware
+//          origin  = The connection that the handshake and response go back to, or an empty
+//                    reference if they should be discarded
+//
+// Returns: true if the message was queued.  If the queue is full, the origin is immediately sent
+//          a "busy" handshake and we return false.  If the firmware isn't alive, the origin is
+//          immediately sent a NAK the same way
 //=================================================================================================
-bool CFWListener::transact(gxip_packet_t& message, bool discard_ack)
+bool CFWListener::transact(gxip_packet_t& message, conn_ref_t origin)
 {
-    // We can't start a transaction in the previous one is still active
-    if (m_is_active) return false;
+    // If the firmware isn't alive, there's no point waiting for it to time out
+    if (!is_firmware_alive())
+    {
+        if (origin) send_nak_handshake_to_host(origin);
+        return false;
+    }
+
+    // Only one thread at a time may be the producer for the queue
+    m_producer_cs.lock();
 
-    // Save the type and ID of this outgoing message
-    m_outgoing_msg_type = message.type;
-    m_outgoing_msg_id   = message.id();
+    // Find out which queue this message goes in
+    int priority = priority_of(message);
+    CSpscQueue<fwl_pending_t, FWL_MAX_PENDING>& queue = m_pending[priority];
+    fwl_class_stats_t& stats = m_class_stats[priority];
 
-    // Send the outgoing message to the firmware
-    CommFifo.send_gxip(message);
+    // If the queue is full, tell the host right away so that it can back off
+    fwl_pending_t* pending = nullptr;
+    if ((int)queue.size() < m_queue_depth) pending = queue.alloc();
+    if (pending == nullptr)
+    {
+        ++stats.rejected;
+        m_producer_cs.unlock();
+        if (origin) send_busy_handshake_to_host(origin);
+        return false;
+    }
 
-    // The listener is going to wait for a handshake message
-    u8 cmd = FWL_HSK;
+    // Copy the message into the back of the queue, and make it visible to the listener
+    memcpy(&pending->packet, &message, message.length());
+    pending->origin      = origin;
+    pending->queued_usec = hrclock_usec();
+    queue.publish();
 
-    // If we're supposed to discard the handshake, set the command flag accordingly
-    if (discard_ack) cmd |= FWL_DISCARD_HSK;
+    // Keep track of how deep the queue gets
+    ++stats.queued;
+    if (queue.size() > stats.high_water) stats.high_water = queue.size();
 
-    // If we just sent a request message, the listener also needs to wait for a response
-    if (message.is_req()) cmd |= FWL_RSP;
+    // We're done being the producer
+    m_producer_cs.unlock();
 
-    // Send this command to the "listener" thread
-    write(m_pipe[1], &cmd, 1);
+    // If the listener is asleep (or about to be), wake it so that it sends the message.  The
+    // fences here and in main() guarantee that either the listener sees the message before it
+    // sleeps or we see that it's sleeping
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (m_is_sleeping) eventfd_write(m_doorbell, 1);
 
-    // And tell the caller that his transaction has been started
+    // And tell the caller that his transaction has been queued
     return true;
 }
 //=================================================================================================
-
@@ -4,6 +4,177 @@
 #pragma once
 #include "cthread.h"
 #include "gxip_struct.h"
+#include <map>
+#include <string>
+#include <atomic>
+#include "fpga_fifo.h"
+#include "latency_hist.h"
+#include "spsc_queue.h"
+#include "connection.h"
+
+//=================================================================================================
+// This is the largest number of transactions that may be outstanding with the firmware at once
+//=================================================================================================
+#define FWL_MAX_TXNS    32
+//=================================================================================================
+
+
+//=================================================================================================
+// This is the largest number of messages of each priority that may be waiting to be sent to the
+// firmware.  It must be a power of two
+//=================================================================================================
+#define FWL_MAX_PENDING 64
+//=================================================================================================
+
+
+//=================================================================================================
+// This is the largest number of connections that can share one transaction, when identical
+// requests are coalesced
+//=================================================================================================
+#define FWL_MAX_WAITERS 8
+//=================================================================================================
+
+
+//=================================================================================================
+// Messages waiting to be sent are scheduled by strict priority: a message is only sent when no
+// message of a more urgent priority is waiting
+//=================================================================================================
+enum {FWL_PRIO_URGENT, FWL_PRIO_NORMAL, FWL_PRIO_BULK, FWL_PRIORITIES};
+//=================================================================================================
+
+
+//=================================================================================================
+// fwl_pending_t - A message that's waiting for room in the transaction window
+//=================================================================================================
+struct fwl_pending_t
+{
+    // The connection that the handshake and response go to, or empty if they're discarded
+    conn_ref_t    origin;
+
+    // The time (from hrclock_usec) at which transact() queued the message
+    u64           queued_usec;
+
+    // A copy of the message.  It's on a 32-bit boundary so it goes to the FIFO fast
+    alignas(4) gxip_packet_t packet;
+};
+//=================================================================================================
+
+
+//=================================================================================================
+// fwl_waiter_t - A connection that's waiting for a transaction's handshake and response
+//=================================================================================================
+struct fwl_waiter_t
+{
+    // The connection
+    conn_ref_t    origin;
+
+    // True until the connection has been sent the handshake
+    bool          wants_hsk;
+};
+//=================================================================================================
+
+
+//=================================================================================================
+// fwl_txn_t - An entry in the transaction table.  A transaction consists of:
+//
+//  (1) Message sent to the firmware
+//  (2) Firmware sends a handshake
+//  (3) Firmware optionally sends a response
+//=================================================================================================
+struct fwl_txn_t
+{
+    // True while this entry describes an outstanding transaction
+    bool          in_use;
+
+    // True while we're waiting for the handshake, and while we're waiting for the response
+    bool          wants_hsk;
+    bool          wants_rsp;
+
+    // True if the response should be stored in the response cache
+    bool          is_cacheable;
+
+    // The connections that the handshake and response go to.  The first is the one that sent
+    // the message, and the rest sent identical requests that were coalesced into it.  Messages
+    // that didn't come from a connection (such as CHCP device broadcasts) have no waiter
+    fwl_waiter_t  waiter[FWL_MAX_WAITERS];
+    int           waiters;
+
+    // The type and ID of the message that was sent to the firmware
+    gxip_type_t   type;
+    u16           id;
+
+    // The sequence tag the message was sent with, or 0 if it was untagged
+    u16           tag;
+
+    // Transactions are numbered in the order their messages were written to the FIFO
+    u32           seq;
+
+    // The time (from hrclock_usec) at which transact() queued the message
+    u64           queued;
+
+    // The time (from hrclock_usec) at which we started waiting for the handshake or response,
+    // and the time at which we give up
+    u64           start;
+    u64           deadline;
+};
+//=================================================================================================
+
+
+//=================================================================================================
+// fwl_latency_t - How long each phase of a transaction takes, for one (type, ID)
+//=================================================================================================
+struct fwl_latency_t
+{
+    CLatencyHist  send;     // From transact() until the message is completely written to the FIFO
+    CLatencyHist  hsk;      // From then until the firmware's handshake arrives
+    CLatencyHist  rsp;      // From the handshake until the firmware's response arrives
+    CLatencyHist  reply;    // From the response arriving until it has been sent to the host
+};
+//=================================================================================================
+
+
+//=================================================================================================
+// fwl_latency_summary_t - A summary of the latencies of each phase of a transaction, for one
+//                         (type, ID).  Latencies are in microseconds
+//=================================================================================================
+enum {FWL_PHASE_SEND, FWL_PHASE_HSK, FWL_PHASE_RSP, FWL_PHASE_REPLY, FWL_PHASES};
+
+struct fwl_latency_summary_t
+{
+    gxip_type_t   type;
+    u16           id;
+    struct {u32 count, p50, p90, p99, max;} phase[FWL_PHASES];
+};
+//=================================================================================================
+
+
+//=================================================================================================
+// fwl_class_stats_t - Counts of the messages waiting to be sent at one priority
+//=================================================================================================
+struct fwl_class_stats_t
+{
+    u32           depth;            // Messages waiting right now
+    u32           high_water;       // The most messages that have ever been waiting
+    u32           queued;           // Messages queued by transact()
+    u32           rejected;         // Messages answered with a "busy" handshake instead
+    u32           dispatched;       // Messages that have left the queue
+    u32           max_wait_usec;    // The longest any message has waited
+    u64           wait_usec;        // The total time that every message has waited
+};
+//=================================================================================================
+
+
+//=================================================================================================
+// fwl_match_stats_t - Counts of the handshakes and responses from the firmware that didn't belong
+//                     to any outstanding transaction, and were thrown away
+//=================================================================================================
+struct fwl_match_stats_t
+{
+    u32           stale_hsks;       // Handshakes
+    u32           stale_rsps;       // Responses
+};
+//=================================================================================================
+
 
 //=================================================================================================
 // CFWListener - Listens for messages from the firmware and sends them back to the host
@@ -18,20 +189,163 @@ public:
     // When this thread starts up, the entry point is here
     void    main(void* p1, void* p2, void* p3);
 
-    // Called by other threads to send a message to he firmware and notify the listener
-    // to expect a response
-    bool    transact(gxip_packet_t& message, bool discard_ack = false);
+    // Sets how many transactions may be outstanding, whether messages are tagged, how many
+    // messages of each priority may wait for room in the window, and whether identical requests
+    // are coalesced
+    void    configure(int window, bool use_tags, int queue_depth, bool coalesce);
+
+    // Sets how timeouts are derived from the latencies we've seen.  Timeouts are the given
+    // percentile of the latency, times a safety factor, but never less than min_ms
+    void    set_timeout_policy(int percentile, int factor, int min_ms, int min_samples);
+
+    // Sets a fixed handshake or response timeout for a message ID, overriding the policy
+    void    set_timeout_override(bool is_rsp, int id, int timeout_ms);
+
+    // Fetches summaries of the latency histograms, starting at the "first"th (type, ID).
+    // Returns the number of summaries fetched, and the number of (type, ID)s there are
+    int     get_latency_stats(int first, fwl_latency_summary_t* out, int max_count, int* p_total);
+
+    // Throws away all the latencies we've recorded
+    void    reset_latency_stats();
+
+    // Sets the priority of messages with a particular ID, and of extended messages (CMD_E and
+    // REQ_E) whose ID doesn't have a priority of its own.  Everything else is FWL_PRIO_NORMAL
+    void    set_priority(int id, int priority);
+    void    set_ext_priority(int priority);
+
+    // Fetches or clears the counts of messages waiting at each priority
+    void    get_priority_stats(fwl_class_stats_t* out);
+    void    reset_priority_stats();
+
+    // Fetches or clears the counts of handshakes and responses that matched no transaction
+    void    get_match_stats(fwl_match_stats_t* p_stats);
+    void    reset_match_stats();
+
+    // Called by other threads to queue a message for the firmware.  The handshake and response
+    // go back to "origin", or are discarded if it's empty.  If the queue is full, this sends the
+    // origin a "busy" handshake and returns false.  If the firmware isn't alive, this sends the
+    // origin a NAK and returns false
+    bool    transact(gxip_packet_t& message, conn_ref_t origin);
 
 protected:
 
-    // These are from the outgoing message of the most recent transaction
-    gxip_type_t   m_outgoing_msg_type;
-    u32           m_outgoing_msg_id;
+    // Matches a handshake or a response from the firmware to an outstanding transaction
+    void    handle_handshake(fifo_msg_t* msg);
+    void    handle_response(fifo_msg_t* msg);
+
+    // Handles every transaction whose deadline has passed
+    void    handle_timeouts();
+
+    // Returns the number of milliseconds until the earliest deadline, or -1 if there is none
+    int     ms_until_next_deadline();
+
+    // Frees an entry in the transaction table
+    void    finish(fwl_txn_t* txn);
+
+    // Returns the latency histograms for a message type and ID
+    fwl_latency_t& latency_of(gxip_type_t type, u16 id);
+
+    // Returns how long to wait for a transaction's handshake or response, in milliseconds
+    int     timeout_ms(fwl_txn_t* txn, bool is_rsp);
+
+    // Writes queued messages to the FIFO while there's room in the window.  Returns false if the
+    // FIFO filled up before the message being written was finished
+    bool    dispatch_pending();
+
+    // Enters the message at the front of the queue into the transaction table
+    void    start_transaction(fwl_pending_t& pending, int priority);
+
+    // Returns the priority that a message should be sent at
+    int     priority_of(gxip_packet_t& message);
+
+    // Returns the most urgent message waiting to be sent and its priority, or nullptr
+    fwl_pending_t* next_pending(int* p_priority);
+
+    // Returns 'true' if any message is waiting to be sent
+    bool    has_pending();
+
+    // Returns 'true' if there's room in the window for another transaction, and we're not
+    // waiting for a late handshake
+    bool    can_start();
+
+    // Counts how long a message waited to leave the queue.  The caller holds m_table_cs
+    void    note_wait(int priority, fwl_pending_t& pending);
+
+    // Attaches a request to an identical one that's already outstanding.  Returns false if
+    // there isn't one
+    bool    coalesce(fwl_pending_t& pending, int priority);
+
+    // The transaction table.  Entries are protected by m_table_cs
+    fwl_txn_t     m_txn[FWL_MAX_TXNS];
+    PCriticalSection m_table_cs;
+
+    // The number of transactions that may be outstanding, and the number that are
+    int           m_window;
+    int           m_outstanding;
+
+    // Counts of the handshakes and responses that matched no transaction.  Protected by m_table_cs
+    fwl_match_stats_t m_match_stats;
+
+    // True if a request has timed out since the last response arrived.  The firmware may still
+    // send the late response, so an untagged response that doesn't match can't be assumed to
+    // belong to the one outstanding request.  Protected by m_table_cs
+    bool          m_rsp_timed_out;
+
+    // True if an untagged handshake has timed out, and the firmware may still send it.  Until it
+    // arrives, or until m_hsk_resync_time, no new transaction starts.  Protected by m_table_cs
+    bool          m_hsk_timed_out;
+    u64           m_hsk_resync_time;
+
+    // When true, each message is sent with a sequence tag that the firmware echoes back
+    bool          m_use_tags;
+
+    // When true, a request that's identical to an outstanding one shares its transaction
+    bool          m_coalesce;
+
+    // The sequence number and tag that will be given to the next transaction
+    u32           m_next_seq;
+    u16           m_next_tag;
+
+    // Messages waiting for room in the window, one queue per priority.  transact() callers take
+    // turns being the single producer by holding m_producer_cs.  The listener is the consumer,
+    // and it leaves each message in its queue until it's completely written
+    CSpscQueue<fwl_pending_t, FWL_MAX_PENDING> m_pending[FWL_PRIORITIES];
+    PCriticalSection m_producer_cs;
+    int           m_queue_depth;
+
+    // The priority of particular message IDs, and of other extended messages.  Protected by
+    // m_producer_cs
+    std::map<int, int> m_priority;
+    int           m_ext_priority;
+
+    // Counts of the messages waiting at each priority.  The fields that transact() updates are
+    // protected by m_producer_cs, and the ones that the listener updates by m_table_cs
+    fwl_class_stats_t m_class_stats[FWL_PRIORITIES];
+
+    // For each outstanding request, the bytes of the request.  They're what coalescing matches
+    // on, and the key that the response is cached under.  Indexed the same as m_txn, and only
+    // touched by the listener thread
+    std::string   m_request[FWL_MAX_TXNS];
+
+    // The message at the front of a queue, its priority and its transaction, while it's being
+    // written
+    fifo_tx_t     m_tx;
+    int           m_tx_priority;
+    fwl_txn_t*    m_tx_txn;
+    bool          m_is_sending;
+
+    // Latency histograms, keyed by (message type << 16 | message ID).  Protected by m_table_cs
+    std::map<u32, fwl_latency_t> m_latency;
+
+    // Fixed timeouts (in milliseconds) for particular message IDs, keyed by message ID
+    std::map<int, int> m_hsk_override, m_rsp_override;
 
-    // Other threads can send us messages by writing to this pipe
-    int           m_pipe[2];
+    // How timeouts are derived from latencies.  See set_timeout_policy()
+    int           m_timeout_pct, m_timeout_factor, m_timeout_min_ms, m_timeout_min_samples;
 
-    // This will be true when we're waiting for and processing a message from the GX
-    bool          m_is_active;
+    // transact() rings this eventfd to tell us that a message has been queued, but only if we're
+    // (about to be) asleep.  While we're awake, we'll find the message without being told
+    int           m_doorbell;
+    std::atomic<bool> m_is_sleeping;
 };
 //=================================================================================================
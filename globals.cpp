@@ -38,9 +38,21 @@ CServer&     MainServer = Server[ASSUMED_SLOT];
 // Listens for and dispatches handshakes and responses from the firmware to the host
 CFWListener  FWListener;
 
+// Drains the FIFO from the firmware and routes each message to whoever consumes it
+CFifoDemux   FifoDemux;
+
 // The gateway download manager
 CDLM         DLM;
 
+// Plays the part of the FPGA and firmware when there is no FPGA
+CFwModel     FwModel;
+
+// Watches the "alive" and "busy" lines from the GX modules
+CPioMonitor  PioMonitor;
+
+// Answers idempotent requests from the host without bothering the firmware
+CResponseCache ResponseCache;
+
 // This holds information about this instrument such as IP address, MAC, serial number, etc
 instrument_t Instrument;
 
@@ -50,11 +62,10 @@ instrument_t Instrument;
 const char* exe_string = "EXEVERSION " VERSION_BUILD;
 
 //=================================================================================================
-// get_live_sites() - In a regular gateway, this would be a bitmap of which slots have GX modules
-//                    attached to them.   Since we have a dedicated module, just say that only the
-//                    first slot has a module in it
+// get_live_sites() - Returns a bitmap of which slots have a live GX module attached to them.
+//                    Without a firmware status PIO, only our own dedicated module is reported
 //=================================================================================================
-int get_live_sites() {return 1;}
+int get_live_sites() {return PioMonitor.live_sites();}
 //=================================================================================================
 
 
@@ -10,7 +10,11 @@
 #include "chcp.h"
 #include "server.h"
 #include "fwlistener.h"
+#include "fifo_demux.h"
 #include "dlm_server.h"
+#include "fw_model.h"
+#include "pio_monitor.h"
+#include "response_cache.h"
 #include "memmap.h"
 
 #define MAX_GXIP_SERVERS 4
@@ -40,8 +44,12 @@ extern CCHCP        CHCP;
 extern CServer      Server[MAX_GXIP_SERVERS];
 extern CServer&     MainServer;
 extern CFWListener  FWListener;
+extern CFifoDemux   FifoDemux;
 extern CDLM         DLM;
 extern CUpdSpec     RestartIP;
+extern CFwModel     FwModel;
+extern CPioMonitor  PioMonitor;
+extern CResponseCache ResponseCache;
 
 int     get_live_sites();
 void    exit_for_restart();
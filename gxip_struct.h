@@ -60,12 +60,12 @@ struct gxip_packet_t
 
     bool    is_ext()
     {
-        return (type == CMD_E_PKT) || (type == RSP_E_PKT);
+        return (type == CMD_E_PKT) || (type == REQ_E_PKT) || (type == RSP_E_PKT);
     }
 
     unsigned short id()
     {
-        if (type == CMD_E_PKT || type == RSP_E_PKT)
+        if (is_ext())
             return (payload[0] << 8) | payload[1];
         return payload[0];
     }
@@ -16,9 +16,6 @@
  *
  *   Add code to handle CHCP device broadcast
  *
- *   What are we going to do about the alive and busy lines?
- *   Also, need a way to transmit "alive" and "busy" from NIOS core to the ARM
- *
  *   Need a way to fetch the FPGA bitstream version
  */
 
@@ -30,7 +27,6 @@
  *     CHCP device broadcast
  *     CTL request for comms stats
  *     CTL request to reset the firmware
- *     CTL request for "get busy sites"
  *     CTL request reset to reload and restart the Nios II
  *
  *
@@ -0,0 +1,106 @@
+//=================================================================================================
+// latency_hist.cpp - Implements a histogram of latencies with logarithmically sized buckets
+//=================================================================================================
+#include <string.h>
+#include "latency_hist.h"
+
+
+//=================================================================================================
+// reset() - Throws away every sample
+//=================================================================================================
+void CLatencyHist::reset()
+{
+    memset(m_bucket, 0, sizeof m_bucket);
+    m_count = 0;
+    m_max   = 0;
+    m_sum   = 0;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// bucket_index() - Returns the index of the bucket that a latency belongs in
+//
+// Latencies 0 thru 3 each get their own bucket.  After that, the bucket is determined by the
+// position of the highest '1' bit and the two bits that follow it
+//=================================================================================================
+int CLatencyHist::bucket_index(u32 usec)
+{
+    // Small latencies each get their own bucket
+    if (usec < 4) return usec;
+
+    // Find the position of the highest '1' bit
+    int exponent = 31 - __builtin_clz(usec);
+
+    // The next two bits choose between the four buckets for this power of two
+    int sub_bucket = (usec >> (exponent - 2)) & 3;
+
+    // And hand the caller the bucket index
+    return 4 * (exponent - 1) + sub_bucket;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// bucket_limit() - Returns the largest latency that a bucket holds
+//=================================================================================================
+u32 CLatencyHist::bucket_limit(int index)
+{
+    // Small latencies each have their own bucket
+    if (index < 4) return index;
+
+    // Undo the arithmetic in bucket_index()
+    int exponent   = index / 4 + 1;
+    int sub_bucket = index % 4;
+    u64 lowest     = (u64)(4 + sub_bucket) << (exponent - 2);
+
+    // This bucket holds everything up to the first latency of the next bucket
+    return lowest + (1ull << (exponent - 2)) - 1;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// record() - Records a single latency
+//=================================================================================================
+void CLatencyHist::record(u32 usec)
+{
+    ++m_bucket[bucket_index(usec)];
+    ++m_count;
+    m_sum += usec;
+    if (usec > m_max) m_max = usec;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// percentile() - Returns the latency that "pct" percent of the samples are at or below
+//
+// The answer is rounded up to the top of the bucket it falls in, but never exceeds the largest
+// latency we've actually seen.  If there are no samples, this returns 0
+//=================================================================================================
+u32 CLatencyHist::percentile(int pct)
+{
+    // If there are no samples, there's no answer
+    if (m_count == 0) return 0;
+
+    // This is how many samples must be at or below the answer (rounded up)
+    u64 wanted = ((u64)m_count * pct + 99) / 100;
+    if (wanted == 0) wanted = 1;
+
+    // Walk through the buckets until we've seen that many samples
+    u64 seen = 0;
+    for (int i=0; i<LATENCY_BUCKETS; ++i)
+    {
+        seen += m_bucket[i];
+        if (seen >= wanted)
+        {
+            u32 limit = bucket_limit(i);
+            return (limit < m_max) ? limit : m_max;
+        }
+    }
+
+    // We only get here if pct is over 100
+    return m_max;
+}
+//=================================================================================================
@@ -0,0 +1,58 @@
+//=================================================================================================
+// latency_hist.h - Defines a histogram of latencies with logarithmically sized buckets
+//=================================================================================================
+#pragma once
+#include "typedefs.h"
+
+//=================================================================================================
+// Each power of two is split into four buckets, so a bucket is never wider than 25% of the
+// values in it.  This many buckets covers every possible u32.
+//=================================================================================================
+#define LATENCY_BUCKETS 124
+//=================================================================================================
+
+
+//=================================================================================================
+// CLatencyHist - Records latencies (in microseconds) and reports percentiles of them
+//
+// This class does no locking of its own
+//=================================================================================================
+class CLatencyHist
+{
+public:
+
+    // Constructor
+    CLatencyHist() {reset();}
+
+    // Throws away every sample
+    void    reset();
+
+    // Records a single latency
+    void    record(u32 usec);
+
+    // Returns the latency that "pct" percent of the samples are at or below
+    u32     percentile(int pct);
+
+    // Returns the number of samples, the largest sample, and the sum of all samples
+    u32     count()     {return m_count;}
+    u32     max()       {return m_max;}
+    u64     sum()       {return m_sum;}
+
+    // Returns the number of samples in a bucket, and the largest latency that bucket holds
+    u32     bucket_count(int index) {return m_bucket[index];}
+    static u32 bucket_limit(int index);
+
+protected:
+
+    // Returns the index of the bucket that a latency belongs in
+    static int bucket_index(u32 usec);
+
+    // The number of samples in each bucket
+    u32     m_bucket[LATENCY_BUCKETS];
+
+    // The number of samples, the largest sample, and the sum of them all
+    u32     m_count;
+    u32     m_max;
+    u64     m_sum;
+};
+//=================================================================================================
@@ -6,6 +6,7 @@
 #include <stdio.h>
 #include <signal.h>
 #include <vector>
+#include <map>
 #include <string>
 #include <algorithm>
 #include <string.h>
@@ -13,6 +14,7 @@
 #include "history.h"
 #include "common.h"
 #include "filesys.h"
+#include "sopcinfo.h"
 using std::vector;
 using std::string;
 
@@ -158,6 +160,228 @@ void read_config()
 
 
 
+//=================================================================================================
+// configure_fifo() - Configures how CommFifo waits for messages from the firmware
+//
+// All of these specs are optional.  Without them, we poll the FIFO every 20 milliseconds
+//=================================================================================================
+void configure_fifo()
+{
+    PString uio_device;
+    int     spin_usec = 0, backoff_usec = 20000, deadline_ms, h2f_depth;
+    bool    adaptive  = false;
+
+    // If the config file names a UIO device for the FIFO interrupt, wait on it instead of polling
+    if (Config.get(SPEC_FIFO_UIO, &uio_device))
+    {
+        if (CommFifo.enable_interrupts(uio_device))
+            printf("Waiting for FIFO interrupts on %s\n", uio_device.c());
+        else
+            printf("Can't open %s, polling the FIFO instead\n", uio_device.c());
+    }
+
+    // Find out how long to spin before sleeping, and how far to back off before blocking
+    Config.get(SPEC_FIFO_SPIN_USEC, &spin_usec);
+    Config.get(SPEC_FIFO_SPIN_ADPT, &adaptive);
+    if (!Config.get(SPEC_FIFO_BACKOFF, &backoff_usec)) backoff_usec = 20000;
+
+    // And hand the wait policy to the FIFO
+    CommFifo.set_wait_policy(spin_usec, adaptive, backoff_usec);
+
+    // Find out how long the firmware has to finish writing a message once it's started
+    if (Config.get(SPEC_FIFO_DEADLINE, &deadline_ms)) CommFifo.set_message_deadline(deadline_ms);
+
+    // Find out how deep the FIFO to the firmware is, so we never write more than it can hold
+    if (Config.get(SPEC_FIFO_H2F_DEPTH, &h2f_depth)) CommFifo.set_output_depth(h2f_depth);
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// parse_id_list() - Parses a list of values (times in milliseconds, priorities) for particular
+//                   message IDs
+//
+// Passed:  spec   = The name of the config spec, which looks like "ID:value, ID:value, ..."
+//          p_list = Receives the value for each message ID
+//
+// IDs may be in decimal, or in hex with a leading "0x"
+//=================================================================================================
+void parse_id_list(const char* spec, std::map<int, int>* p_list)
+{
+    PString list;
+    char*   end;
+
+    // If the config file doesn't have this spec, there's nothing to do
+    if (!Config.get(spec, &list)) return;
+
+    // Get a pointer to the list
+    const char* p = list.c();
+
+    while (*p)
+    {
+        // Parse the ID, and skip past the colon that should follow it
+        int id = strtol(p, &end, 0);
+        if (end == p || *end != ':')
+        {
+            printf("Malformed %s spec at \"%s\"\n", spec, p);
+            return;
+        }
+        p = end + 1;
+
+        // Parse the value
+        int value = strtol(p, &end, 10);
+        if (end == p)
+        {
+            printf("Malformed %s spec at \"%s\"\n", spec, p);
+            return;
+        }
+        p = end;
+
+        // And hand it to the caller
+        (*p_list)[id] = value;
+
+        // Skip over the separators before the next entry
+        while (*p == ',' || *p == ' ' || *p == '\t') ++p;
+    }
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// configure_listener() - Configures how many transactions may be outstanding with the firmware,
+//                        and how many more may wait their turn
+//
+// All of these specs are optional.  Without them, we have one transaction at a time, untagged,
+// with up to 16 more waiting, and timeouts of 4 times the 99th percentile latency.  Identical
+// requests are coalesced only when their ID is cacheable, unless FW_COALESCE_REQS says otherwise,
+// because two identical requests don't always deserve the same answer (a read-and-clear of a
+// counter, for instance)
+//=================================================================================================
+void configure_listener()
+{
+    int  window, depth;
+    bool use_tags, coalesce;
+
+    // Find out how many transactions the host may pipeline, and whether the firmware echoes tags
+    if (!Config.get(SPEC_FW_TXN_WINDOW, &window  )) window   = 1;
+    if (!Config.get(SPEC_FIFO_SEQ_TAGS, &use_tags)) use_tags = false;
+
+    // Find out how many messages may wait for room in the window before the host is told "busy"
+    if (!Config.get(SPEC_FW_TXN_QUEUE, &depth)) depth = 16;
+
+    // Find out whether identical requests may share a single trip to the firmware
+    if (!Config.get(SPEC_FW_COALESCE, &coalesce)) coalesce = false;
+
+    // And hand them to the listener
+    FWListener.configure(window, use_tags, depth, coalesce);
+
+    // Find out how timeouts are derived from the latencies we see
+    int pct, factor, min_ms, min_samples;
+    if (!Config.get(SPEC_FW_TMO_PCT,     &pct        )) pct         = 99;
+    if (!Config.get(SPEC_FW_TMO_FACTOR,  &factor     )) factor      = 4;
+    if (!Config.get(SPEC_FW_TMO_MIN_MS,  &min_ms     )) min_ms      = 100;
+    if (!Config.get(SPEC_FW_TMO_SAMPLES, &min_samples)) min_samples = 20;
+    FWListener.set_timeout_policy(pct, factor, min_ms, min_samples);
+
+    // Fetch the fixed timeouts for particular message IDs
+    std::map<int, int> hsk_tmo, rsp_tmo;
+    parse_id_list(SPEC_FW_HSK_TMO, &hsk_tmo);
+    parse_id_list(SPEC_FW_RSP_TMO, &rsp_tmo);
+    for (auto& it : hsk_tmo) FWListener.set_timeout_override(false, it.first, it.second);
+    for (auto& it : rsp_tmo) FWListener.set_timeout_override(true,  it.first, it.second);
+
+    // Find out which messages are more (0) or less (2) urgent than normal (1)
+    int ext_priority;
+    std::map<int, int> priority;
+    if (!Config.get(SPEC_FW_EXT_PRIO, &ext_priority)) ext_priority = FWL_PRIO_NORMAL;
+    parse_id_list(SPEC_FW_PRIORITY, &priority);
+    FWListener.set_ext_priority(ext_priority);
+    for (auto& it : priority) FWListener.set_priority(it.first, it.second);
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// configure_cache() - Configures which requests have their responses cached, and for how long
+//
+// This spec is optional.  Without it, nothing is cached
+//=================================================================================================
+void configure_cache()
+{
+    std::map<int, int> ttl;
+
+    // Fetch the TTL of each cacheable message ID
+    parse_id_list(SPEC_RSP_CACHE_TTL, &ttl);
+
+    // And hand them to the cache
+    for (auto& it : ttl) ResponseCache.set_ttl(it.first, it.second);
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// configure_pio_monitor() - Finds the PIO that carries the "alive" and "busy" lines
+//
+// Both specs are optional.  Without FW_STATUS_PIO, our own module is always alive and never busy.
+// Without FW_STATUS_UIO, the PIO is polled every 10 milliseconds
+//=================================================================================================
+void configure_pio_monitor()
+{
+    PString offset, uio_device;
+
+    // If the config file doesn't say where the status PIO is, there's nothing to monitor
+    if (!Config.get(SPEC_FW_STATUS_PIO, &offset)) return;
+
+    // The offset may be in decimal, or in hex with a leading "0x"
+    PioMonitor.init(MM, strtoul(offset.c(), nullptr, 0));
+
+    // If the config file names a UIO device for the PIO's edge interrupt, wait on it
+    if (Config.get(SPEC_FW_STATUS_UIO, &uio_device))
+    {
+        if (PioMonitor.enable_interrupts(uio_device))
+            printf("Waiting for firmware status interrupts on %s\n", uio_device.c());
+        else
+            printf("Can't open %s, polling the firmware status instead\n", uio_device.c());
+    }
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// setup_emulation() - Replaces the FPGA register window with an emulated one
+//
+// This allows the gateway to run (and be benchmarked) on a machine that has no FPGA.  It's
+// selected with "MEMMAP = emulated" in the config file, or "-emulate" on the command line.
+//=================================================================================================
+void setup_emulation()
+{
+    // Map an emulated register window in place of the physical one
+    if (!MM.open_emulated(HW_REGS_SPAN))
+    {
+        printf("Emulated memory map failed!\n");
+        exit(1);
+    }
+
+    // Attach the firmware model to the emulated registers
+    FwModel.init(MM);
+
+    // Find out how quickly the firmware model should handshake and respond
+    int hsk_usec, rsp_usec;
+    if (!Config.get(SPEC_EMU_HSK_USEC, &hsk_usec)) hsk_usec = 100;
+    if (!Config.get(SPEC_EMU_RSP_USEC, &rsp_usec)) rsp_usec = 1000;
+    FwModel.set_timing(hsk_usec, rsp_usec);
+
+    // Find out how often the firmware model should send an unsolicited event
+    int event_ms;
+    if (!Config.get(SPEC_EMU_EVENT_MS, &event_ms)) event_ms = 0;
+    FwModel.set_event_period(event_ms);
+
+    // Tell the engineer what's up
+    printf("Using emulated FPGA registers (HSK %ius, RSP %ius)\n", hsk_usec, rsp_usec);
+}
+//=================================================================================================
+
+
 //=================================================================================================
 // init() - Reads the configuration file and initializes all global objects
 //=================================================================================================
@@ -171,7 +395,23 @@ void init()
     }
 
     // Initialize the FIFO we use to communicate with the firmware on the Nios-II
-    CommFifo.init(MM);
+    if (!CommFifo.init(MM))
+    {
+        printf("FIFO initialization failed!\n");
+        exit(1);
+    }
+
+    // Tell the FIFO how it should wait for incoming messages
+    configure_fifo();
+
+    // Tell the listener how many transactions may be outstanding
+    configure_listener();
+
+    // Find out where the firmware's "alive" and "busy" lines are
+    configure_pio_monitor();
+
+    // Find out which responses may be cached
+    configure_cache();
 
     // Read in the configuration file
     if (!EEPROM.load())
@@ -199,15 +439,19 @@ void init()
 //=================================================================================================
 void launch_servers()
 {
-    int i;
+    int i, high_water;
 
     // Start the download manager
     DLM.spawn();
 
+    // Find out how far behind a client may fall before we stop reading its requests
+    if (!Config.get(SPEC_SRV_TX_HIWATER, &high_water)) high_water = CONN_TX_SIZE / 2;
+
     // Launch all of the normal command/request servers
     for (i=0; i<MAX_GXIP_SERVERS; ++i)
     {
         Server[i].set_slot(i);
+        Server[i].set_tx_high_water(high_water);
         Server[i].spawn();
     }
 
@@ -234,12 +478,32 @@ int main(int argc, char** argv)
     // Read our configuration file
     read_config();
 
+    // Find out whether we should emulate the FPGA instead of using the real one
+    PString memmap;
+    bool emulate = Config.get(SPEC_MEMMAP, &memmap) && memmap == "emulated";
+    for (int i=1; i<argc; ++i) if (strcmp(argv[i], "-emulate") == 0) emulate = true;
+    if (emulate) setup_emulation();
+
     // Make sure that the file-system is mounted read-only
     if (Instrument.lock_fs) remount_ro();
 
     // Read in our spec-file and initialize all of our global objects
     init();
 
+    // If the FPGA is emulated, start the thread that plays the part of the firmware
+    if (MM.is_emulated())
+    {
+        FwModel.set_irq(CommFifo.get_irq());
+        FwModel.set_status_pio(PioMonitor.get_pio(), PioMonitor.get_irq());
+        FwModel.spawn();
+    }
+
+    // Launch the thread that watches the firmware's "alive" and "busy" lines
+    if (PioMonitor.is_enabled()) PioMonitor.spawn();
+
+    // Launch the thread that drains the FIFO from the firmware
+    FifoDemux.spawn();
+
     // Launch the thread that listens for messages from the firmware
     FWListener.spawn();
 
@@ -35,6 +35,47 @@ bool CMemMap::open(off_t where, size_t length)
 //=================================================================================================
 
 
+//=================================================================================================
+// open_emulated() - Maps a block of shared memory that takes the place of the FPGA registers on
+//                   machines that don't have an FPGA.  A firmware model (see fw_model.h) plays
+//                   the part of the hardware behind those registers.
+//=================================================================================================
+bool CMemMap::open_emulated(size_t length)
+{
+    // Close any open map
+    close();
+
+    // Create an anonymous shared memory file to hold the register window
+    m_fd = memfd_create("g2gateway_regs", MFD_CLOEXEC);
+
+    // If we weren't able to create it, something had gone terribly wrong
+    if (m_fd < 0) return false;
+
+    // Make the file large enough to hold the register window.  It starts out as all zeros
+    if (ftruncate(m_fd, length) < 0)
+    {
+        close();
+        return false;
+    }
+
+    // Map the shared memory file into user space
+    m_base = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+
+    // Did that call to mmap work properly?
+    m_is_mapped = (m_base != MAP_FAILED);
+
+    // If the memory map failed, close the shared memory file
+    if (!m_is_mapped) close();
+
+    // Keep track of the fact that this is an emulated register window
+    m_is_emulated = m_is_mapped;
+
+    // Tell the caller whether this worked
+    return m_is_mapped;
+}
+//=================================================================================================
+
+
 //=================================================================================================
 // operator[] - Returns a userspace pointer to the specified address in physical memory
 //=================================================================================================
@@ -50,6 +91,7 @@ void CMemMap::close()
     if (m_fd != -1) ::close(m_fd);
     m_fd = -1;
     m_is_mapped = false;
+    m_is_emulated = false;
     m_base = nullptr;
 }
 //=================================================================================================
@@ -17,12 +17,18 @@ public:
     // Call this to map the physical memory
     bool    open(off_t where, size_t length);
 
+    // Call this to map an emulated register window instead of physical memory
+    bool    open_emulated(size_t length);
+
     // Closes /dev/mem.  Called automatically by destructor
     void    close();
 
     // Find out if we have physical memory mapped into user space
     bool    is_mapped() {return m_is_mapped;}
 
+    // Find out if the memory we have mapped is an emulated register window
+    bool    is_emulated() {return m_is_emulated;}
+
     // Returns a user-space pointer to a physical address
     void*   operator[](unsigned int address);
 
@@ -36,6 +42,9 @@ protected:
 
     // This will be true when we have physical memory mapped into user space
     bool    m_is_mapped;
+
+    // This will be true when the memory we have mapped is emulated rather than physical
+    bool    m_is_emulated;
 };
 
 
@@ -0,0 +1,104 @@
+//=================================================================================================
+// pio_monitor.cpp - Implements a thread that watches the "alive" and "busy" lines from the GX
+//                   modules
+//=================================================================================================
+#include <unistd.h>
+#include "pio_monitor.h"
+#include "common.h"
+
+
+//=================================================================================================
+// When there's no interrupt, this is how often (in milliseconds) we look at the PIO.  When there
+// is one, this is how often we look anyway, in case an edge was somehow missed
+//=================================================================================================
+#define PIO_POLL_MS     10
+#define PIO_IRQ_POLL_MS 1000
+//=================================================================================================
+
+
+//=================================================================================================
+// Constructor() - Until we have a PIO, our own module is alive and nobody is busy
+//=================================================================================================
+CPioMonitor::CPioMonitor()
+{
+    m_pio    = nullptr;
+    m_status = (1 << ASSUMED_SLOT) << PIO_ALIVE_SHIFT;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// init() - Finds the status PIO and arms its edge capture
+//
+// Passed:  mm     = The register window
+//          offset = The offset of the status PIO within the register window
+//=================================================================================================
+bool CPioMonitor::init(CMemMap& mm, u32 offset)
+{
+    // These are the lines we care about
+    const u32 mask = (PIO_SITE_MASK << PIO_ALIVE_SHIFT) | (PIO_SITE_MASK << PIO_BUSY_SHIFT);
+
+    // Find the PIO in the register window
+    m_pio = (pio_t*)mm[offset];
+
+    // Throw away any edges captured before we got here, and interrupt on any new ones
+    m_pio->edge    = mask;
+    m_pio->intmask = mask;
+
+    // Fetch the current state of the lines
+    sample();
+
+    // Tell the caller that all is well
+    return true;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// enable_interrupts() - Opens the UIO device that the PIO's edge capture interrupt is routed to
+//
+// Passed:  uio_device = The UIO device (i.e., "/dev/uio1"), or "sim" for a simulated device
+//=================================================================================================
+bool CPioMonitor::enable_interrupts(const char* uio_device)
+{
+    return m_irq.open(uio_device);
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// sample() - Acknowledges any captured edges and refreshes the cached copy of the lines
+//=================================================================================================
+void CPioMonitor::sample()
+{
+    // Find out which lines have changed.  Writing the bits back clears them, and we do that
+    // before reading the lines so that any later edge interrupts us again
+    u32 edges = m_pio->edge;
+    if (edges) m_pio->edge = edges;
+
+    // And cache the current state of the lines
+    m_status = m_pio->data;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// main() - When this thread spawns, execution starts here
+//=================================================================================================
+void CPioMonitor::main(void* p1, void* p2, void* p3)
+{
+    while (true)
+    {
+        // Pick up anything that changed while we weren't looking
+        sample();
+
+        // Wait for an edge interrupt, or if there isn't one, for a little while
+        if (m_irq.is_open())
+        {
+            m_irq.enable();
+            m_irq.wait(PIO_IRQ_POLL_MS);
+        }
+        else usleep(PIO_POLL_MS * 1000);
+    }
+}
+//=================================================================================================
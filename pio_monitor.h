@@ -0,0 +1,71 @@
+//=================================================================================================
+// pio_monitor.h - Defines a thread that watches the "alive" and "busy" lines from the GX modules
+//=================================================================================================
+#pragma once
+#include <atomic>
+#include "cthread.h"
+#include "memmap.h"
+#include "uio.h"
+#include "altera_peripherals.h"
+#include "typedefs.h"
+
+//=================================================================================================
+// The firmware status PIO has one "alive" line and one "busy" line per site.  The alive lines are
+// bits 0 thru 7 of the PIO data register, and the busy lines are bits 8 thru 15
+//=================================================================================================
+#define PIO_ALIVE_SHIFT 0
+#define PIO_BUSY_SHIFT  8
+#define PIO_SITE_MASK   0xFF
+//=================================================================================================
+
+
+//=================================================================================================
+// CPioMonitor - Keeps a cached copy of the alive and busy lines, so that nobody has to touch the
+//               PIO to find out whether a module is alive or busy.  The cache is refreshed each
+//               time the PIO's edge-capture interrupt fires, or periodically if there's no UIO
+//               device for that interrupt.
+//
+// Until init() is called, every site is reported not-busy, and only ASSUMED_SLOT is alive
+//=================================================================================================
+class CPioMonitor : public CThread
+{
+public:
+
+    // Constructor
+    CPioMonitor();
+
+    // When this thread starts up, the entry point is here
+    void    main(void* p1, void* p2, void* p3);
+
+    // Finds the status PIO at the given offset in the register window and arms its edge capture
+    bool    init(CMemMap& mm, u32 offset);
+
+    // Wait for edge interrupts on a UIO device instead of by polling
+    bool    enable_interrupts(const char* uio_device);
+
+    // Returns 'true' if init() has been called
+    bool    is_enabled() {return m_pio != nullptr;}
+
+    // Returns bitmaps of which sites are alive, and which are busy
+    u8      live_sites() {return (m_status >> PIO_ALIVE_SHIFT) & PIO_SITE_MASK;}
+    u8      busy_sites() {return (m_status >> PIO_BUSY_SHIFT ) & PIO_SITE_MASK;}
+
+    // Returns the status PIO and its interrupt line, for the firmware model to drive
+    pio_t*  get_pio()    {return (pio_t*)m_pio;}
+    CUio*   get_irq()    {return m_irq.is_open() ? &m_irq : nullptr;}
+
+protected:
+
+    // Acknowledges any captured edges and refreshes the cached copy of the lines
+    void    sample();
+
+    // The status PIO, or nullptr if there isn't one
+    volatile pio_t*     m_pio;
+
+    // The interrupt line that the PIO's edge capture is routed to
+    CUio                m_irq;
+
+    // The most recent value of the alive and busy lines
+    std::atomic<u32>    m_status;
+};
+//=================================================================================================
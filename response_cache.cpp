@@ -0,0 +1,186 @@
+//=================================================================================================
+// response_cache.cpp - Implements a cache of firmware responses to idempotent GXIP requests
+//=================================================================================================
+#include <string.h>
+#include "response_cache.h"
+#include "hrclock.h"
+
+
+//=================================================================================================
+// Constructor() - Nothing is cacheable until set_ttl() says so
+//=================================================================================================
+CResponseCache::CResponseCache()
+{
+    m_hits        = 0;
+    m_misses      = 0;
+    m_bytes_saved = 0;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// set_ttl() - Makes requests with the given message ID cacheable
+//
+// Passed:  id     = The message ID
+//          ttl_ms = How long (in milliseconds) a response stays valid.  0 makes the ID uncacheable
+//=================================================================================================
+void CResponseCache::set_ttl(int id, int ttl_ms)
+{
+    PSingleLock lock(&m_cs);
+    if (ttl_ms > 0)
+        m_ttl[id] = ttl_ms;
+    else
+        m_ttl.erase(id);
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// is_cacheable() - Returns 'true' if the firmware's response to this request may be cached
+//=================================================================================================
+bool CResponseCache::is_cacheable(gxip_packet_t& request)
+{
+    // Only requests get responses
+    if (!request.is_req()) return false;
+
+    // And only the message IDs we've been told about are cached
+    PSingleLock lock(&m_cs);
+    return m_ttl.find(request.id()) != m_ttl.end();
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// key_of() - Returns the key that a request is cached under, which is every byte of it
+//=================================================================================================
+std::string CResponseCache::key_of(gxip_packet_t& request)
+{
+    return std::string((const char*)&request, request.length());
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// lookup() - Looks for an unexpired response to a request
+//
+// Passed:  request    = The request from the host
+//          p_response = Where to copy the cached response
+//
+// Returns: true if the response was found.  Requests that aren't cacheable always return false
+//          and aren't counted as misses
+//=================================================================================================
+bool CResponseCache::lookup(gxip_packet_t& request, gxip_packet_t* p_response)
+{
+    // If this request isn't cacheable, don't bother looking
+    if (!is_cacheable(request)) return false;
+
+    // Lock the cache while we look
+    PSingleLock lock(&m_cs);
+
+    // Look for a response to this exact request that hasn't expired
+    auto it = m_entry.find(key_of(request));
+    if (it == m_entry.end() || it->second.expires <= hrclock_usec())
+    {
+        ++m_misses;
+        return false;
+    }
+
+    // Hand the caller the response
+    std::string& response = it->second.response;
+    memcpy(p_response, response.data(), response.size());
+
+    // Neither the request nor the response had to cross the FIFO
+    ++m_hits;
+    m_bytes_saved += request.length() + response.size();
+    return true;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// purge_expired() - Throws away every expired response
+//=================================================================================================
+void CResponseCache::purge_expired(u64 now)
+{
+    for (auto it = m_entry.begin(); it != m_entry.end();)
+    {
+        if (it->second.expires <= now)
+            it = m_entry.erase(it);
+        else
+            ++it;
+    }
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// store() - Caches the firmware's response to a request
+//
+// Passed:  key      = The request's bytes, from key_of()
+//          response = The firmware's response
+//=================================================================================================
+void CResponseCache::store(const std::string& key, gxip_packet_t& response)
+{
+    // Find out what time it is
+    u64 now = hrclock_usec();
+
+    // Lock the cache
+    PSingleLock lock(&m_cs);
+
+    // The key starts with the request's 2-byte length and type, and then its ID.  If the ID
+    // has become uncacheable since the request was sent, don't cache the response
+    auto ttl = m_ttl.find(((gxip_packet_t*)key.data())->id());
+    if (ttl == m_ttl.end()) return;
+
+    // If the cache is full, make room by throwing out expired responses.  If that doesn't help,
+    // this response just doesn't get cached
+    if (m_entry.size() >= RSP_CACHE_MAX_ENTRIES && m_entry.find(key) == m_entry.end())
+    {
+        purge_expired(now);
+        if (m_entry.size() >= RSP_CACHE_MAX_ENTRIES) return;
+    }
+
+    // Cache the response
+    entry_t& entry = m_entry[key];
+    entry.expires  = now + ttl->second * 1000ull;
+    entry.response.assign((const char*)&response, response.length());
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// flush() - Throws away every cached response
+//=================================================================================================
+void CResponseCache::flush()
+{
+    PSingleLock lock(&m_cs);
+    m_entry.clear();
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// get_stats() - Fetches the counts of how well the cache is doing
+//=================================================================================================
+void CResponseCache::get_stats(rsp_cache_stats_t* p_stats)
+{
+    PSingleLock lock(&m_cs);
+    p_stats->hits        = m_hits;
+    p_stats->misses      = m_misses;
+    p_stats->entries     = m_entry.size();
+    p_stats->bytes_saved = m_bytes_saved;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// reset_stats() - Clears the hit and miss counts
+//=================================================================================================
+void CResponseCache::reset_stats()
+{
+    PSingleLock lock(&m_cs);
+    m_hits        = 0;
+    m_misses      = 0;
+    m_bytes_saved = 0;
+}
+//=================================================================================================
@@ -0,0 +1,92 @@
+//=================================================================================================
+// response_cache.h - Defines a cache of firmware responses to idempotent GXIP requests
+//=================================================================================================
+#pragma once
+#include <map>
+#include <string>
+#include "cthread.h"
+#include "gxip_struct.h"
+#include "typedefs.h"
+
+//=================================================================================================
+// This is the largest number of responses that may be cached at once
+//=================================================================================================
+#define RSP_CACHE_MAX_ENTRIES 256
+//=================================================================================================
+
+
+//=================================================================================================
+// rsp_cache_stats_t - Counts of how well the cache is doing
+//=================================================================================================
+struct rsp_cache_stats_t
+{
+    u32     hits;           // Cacheable requests answered from the cache
+    u32     misses;         // Cacheable requests that had to go to the firmware
+    u32     entries;        // Responses currently in the cache
+    u64     bytes_saved;    // Request and response bytes that didn't cross the FIFO
+};
+//=================================================================================================
+
+
+//=================================================================================================
+// CResponseCache - Remembers the firmware's response to a request for a configurable time, so
+//                  that an identical request within that time can be answered without asking the
+//                  firmware.  Only request IDs that have been given a TTL are cached, and the
+//                  cache is keyed by every byte of the request.
+//=================================================================================================
+class CResponseCache
+{
+public:
+
+    // Constructor
+    CResponseCache();
+
+    // Makes requests with the given message ID cacheable for ttl_ms milliseconds
+    void    set_ttl(int id, int ttl_ms);
+
+    // Returns 'true' if responses to this request may be cached
+    bool    is_cacheable(gxip_packet_t& request);
+
+    // Looks for an unexpired response to this request.  Returns 'true' and fills in p_response
+    // if there is one
+    bool    lookup(gxip_packet_t& request, gxip_packet_t* p_response);
+
+    // Caches the firmware's response to a request.  "key" is the request's bytes
+    void    store(const std::string& key, gxip_packet_t& response);
+
+    // Returns the key that a request is cached under
+    static std::string key_of(gxip_packet_t& request);
+
+    // Throws away every cached response
+    void    flush();
+
+    // Fetches or clears the hit and miss counts
+    void    get_stats(rsp_cache_stats_t* p_stats);
+    void    reset_stats();
+
+protected:
+
+    // A cached response, and the time (from hrclock_usec) at which it expires
+    struct entry_t
+    {
+        u64         expires;
+        std::string response;
+    };
+
+    // Throws away every expired response
+    void    purge_expired(u64 now);
+
+    // The TTL (in milliseconds) of each cacheable message ID
+    std::map<int, int> m_ttl;
+
+    // The cached responses, keyed by the bytes of the request
+    std::map<std::string, entry_t> m_entry;
+
+    // Counts of how well the cache is doing
+    u32     m_hits, m_misses;
+    u64     m_bytes_saved;
+
+    // Protects everything above
+    PCriticalSection m_cs;
+};
+//=================================================================================================
@@ -2,7 +2,9 @@
 // server.cpp -Implements threads that manage our TCP connections to the outside world
 //=================================================================================================
 #include <unistd.h>
-#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <stddef.h>
 #include <string.h>
 #include "altera_peripherals.h"
 #include "sopcinfo.h"
@@ -11,6 +13,7 @@
 #include "globals.h"
 #include "gxip_struct.h"
 #include "common.h"
+#include "hrclock.h"
 
 
 //=================================================================================================
@@ -32,6 +35,23 @@ void dump_gxip_packet(u8* p)
 //=================================================================================================
 
 
+//=================================================================================================
+// These tell us what woke us up when epoll_wait() returns.  For a connection's socket, its
+// unsolicited-message doorbell, or its outbound doorbell, the low bits are the index of the
+// connection
+//=================================================================================================
+#define EP_SPECIAL      0x10000
+#define EP_LISTENER     0x20000
+#define EP_SOCKET       0x30000
+#define EP_EVENTS       0x40000
+#define EP_OUTBOUND     0x50000
+#define EP_KIND_MASK    0xFF0000
+#define EP_INDEX_MASK   0x00FFFF
+//=================================================================================================
+
+
+
+
 //=================================================================================================
 // The version number of the GXIP protocol that we use to communicate with the TCP client
 //=================================================================================================
@@ -53,6 +73,17 @@ void dump_gxip_packet(u8* p)
 #define CTL_GET_BUSY_SITES    9
 #define CTL_ECHO             10
 #define CTL_GET_DLM_VERSION  11
+#define CTL_GET_WAIT_STATS   12
+#define CTL_GET_FIFO_STATS   13
+#define CTL_GET_LATENCY_STATS 14
+#define CTL_RESET_STATS      15
+#define CTL_GET_CACHE_STATS  16
+#define CTL_GET_PRIORITY_STATS 17
+#define CTL_SUBSCRIBE        18
+#define CTL_UNSUBSCRIBE      19
+#define CTL_GET_RX_STATS     20
+#define CTL_GET_TX_STATS     21
+#define CTL_GET_COM_STATS_EXT 22
 //=================================================================================================
 
 
@@ -148,86 +179,199 @@ struct ctl_reset_rsp_t
     u8            status;
 };
 
-struct ctl_echo_req_t
+struct ctl_get_wait_stats_rsp_t
 {
     ctl_header_t  header;
-    u8            data[256];
+    u32be         waits;
+    u32be         spin_hits;
+    u32be         sleep_hits;
+    u32be         irq_hits;
+    u32be         timeouts;
+    u32be         sleeps;
+    u32be         spin_msec;
+    u32be         spin_budget_usec;
 };
 
-#pragma pack(pop)
-//=================================================================================================
+struct ctl_fifo_dir_stats_t
+{
+    u64be         words;
+    u32be         messages;
+    u32be         level;
+    u32be         high_water;
+    u32be         overflows;
+    u32be         underflows;
+    u32be         wait_msec;
+    u32be         fill_hist[FIFO_FILL_BUCKETS];
+};
 
+struct ctl_get_fifo_stats_rsp_t
+{
+    ctl_header_t          header;
+    ctl_fifo_dir_stats_t  h2f;
+    ctl_fifo_dir_stats_t  f2h;
+    u32be                 f2h_resyncs;
+    u32be                 stale_hsks;
+    u32be                 stale_rsps;
+};
 
+struct ctl_get_latency_stats_req_t
+{
+    ctl_header_t  header;
+    u16be         first;
+};
 
+struct ctl_latency_phase_t
+{
+    u32be         count;
+    u32be         p50_usec;
+    u32be         p90_usec;
+    u32be         p99_usec;
+    u32be         max_usec;
+};
 
-//=================================================================================================
-// bytes_availabe() - Returns the number of bytes available to be read on a file-descriptor
-//=================================================================================================
-static int bytes_available(int fd)
+struct ctl_latency_entry_t
 {
-    int count;
-    ioctl(fd, FIONREAD, &count);
-    return count;
-}
-//=================================================================================================
+    u8                   msg_type;
+    u16be                msg_id;
+    ctl_latency_phase_t  phase[FWL_PHASES];
+};
 
+#define CTL_LATENCY_ENTRIES 24
 
+struct ctl_get_latency_stats_rsp_t
+{
+    ctl_header_t         header;
+    u16be                total;
+    u16be                first;
+    u8                   count;
+    ctl_latency_entry_t  entry[CTL_LATENCY_ENTRIES];
+};
 
-//=================================================================================================
-// drain_fd() - Drains (and throws away) all bytes available for reading on a file descriptor
-//=================================================================================================
-static void drain_fd(int fd)
+struct ctl_reset_stats_rsp_t
 {
-    int  count;
-    char buffer[100];
+    ctl_header_t  header;
+    u8            status;
+};
 
-    while ((count = bytes_available(fd)))
-    {
-        if (count > sizeof buffer) count = sizeof buffer;
-        read(fd, buffer, count);
-    }
-}
-//=================================================================================================
+struct ctl_get_cache_stats_rsp_t
+{
+    ctl_header_t  header;
+    u32be         hits;
+    u32be         misses;
+    u32be         entries;
+    u64be         bytes_saved;
+};
+
+struct ctl_class_stats_t
+{
+    u32be         depth;
+    u32be         high_water;
+    u32be         queued;
+    u32be         rejected;
+    u32be         dispatched;
+    u32be         max_wait_usec;
+    u64be         wait_usec;
+};
+
+struct ctl_subscribe_req_t
+{
+    ctl_header_t  header;
+    u16be         first_id;
+    u16be         last_id;
+};
 
+struct ctl_subscribe_rsp_t
+{
+    ctl_header_t  header;
+    u8            status;
+    u8            ranges;
+    u32be         forwarded;
+    u32be         dropped;
+};
 
+struct ctl_get_rx_stats_rsp_t
+{
+    ctl_header_t  header;
+    u64be         wakeups;
+    u64be         reads;
+    u64be         bytes;
+    u64be         messages;
+    u32be         syscalls_per_100_msgs;
+};
 
-//=================================================================================================
-// Constructor() - Make sure we start in a known state
-//=================================================================================================
-CServer::CServer()
+struct ctl_get_com_stats_ext_rsp_t
 {
-    // When we start, we are neither initialized, nor connected to a client
-    m_is_connected   = false;
-    m_is_initialized = false;
-}
-//=================================================================================================
+    ctl_header_t  header;
+    u64be         uptime_msec;
+    u64be         stats_age_msec;
+    u64be         bytes_in;
+    u64be         bytes_out;
+    u64be         naks_in;
+    u64be         naks_out;
+    u64be         cans_in;
+    u64be         cans_out;
+    u64be         busys_out;
+    u64be         mrms_out;
+    u64be         dropped;
+    u8            types;
+    u64be         msgs_in [COM_PKT_TYPES];
+    u64be         msgs_out[COM_PKT_TYPES];
+};
 
+struct ctl_get_tx_stats_rsp_t
+{
+    ctl_header_t  header;
+    u64be         writes;
+    u64be         bytes;
+    u64be         messages;
+    u32be         blocked;
+    u32be         high_water;
+    u32be         backlog;
+    u32be         throttled;
+    u32be         overflows;
+};
 
-//=================================================================================================
-// read_gxip_msg_from_socket() - Fetches a GXIP message from the socket
-//=================================================================================================
-bool CServer::read_gxip_msg_from_socket()
+struct ctl_get_priority_stats_rsp_t
 {
-    char* remaining_packet = ((char*)&m_gxip_packet)+2;
-    int   remaining_size   = sizeof(m_gxip_packet) - 2;
+    ctl_header_t       header;
+    u8                 count;
+    ctl_class_stats_t  priority[FWL_PRIORITIES];
+};
 
-    // Read the first two bytes of the message, it's the msg length
-    if (m_socket.receive(&m_gxip_packet, 2) < 2) return false;
+struct ctl_echo_req_t
+{
+    ctl_header_t  header;
+    u8            data[256];
+};
 
-    // Find out how long entire message is (including the two length bytes)
-    int msg_length = m_gxip_packet.length();
+#pragma pack(pop)
+//=================================================================================================
 
-    // This is how many more bytes we should find in this message
-    int bytes_expected = msg_length - 2;
 
-    // If this can't possibly be a valid length, close the socket
-    if (bytes_expected < 1 || bytes_expected > remaining_size) return false;
 
-    // Read in the rest of the message
-    int bytes_read = m_socket.receive(remaining_packet, bytes_expected);
 
-    // Tell the caller whether we read an entire message
-    return (bytes_read == bytes_expected);
+//=================================================================================================
+// Constructor() - Make sure we start in a known state
+//=================================================================================================
+CServer::CServer()
+{
+    // When we start, we aren't initialized, and no client is being handled
+    m_is_initialized = false;
+    m_epoll_fd       = -1;
+    m_client         = nullptr;
+
+    // We haven't read or sent anything yet
+    memset(&m_rx_stats, 0, sizeof m_rx_stats);
+    m_tx_throttled = 0;
+    m_tx_overflows = 0;
+
+    // Our connections count their traffic in our communication statistics
+    for (auto& conn : m_conn) conn.set_com_stats(&m_com_stats);
+    m_start_usec     = hrclock_usec();
+    m_com_stats_usec = m_start_usec;
+
+    // Until we're told otherwise, stop reading from a client when half its queue is waiting
+    m_tx_high_water = CONN_TX_SIZE / 2;
 }
 //=================================================================================================
 
@@ -251,13 +395,44 @@ void CServer::set_slot(int slot)
 //=================================================================================================
 
 
+//=================================================================================================
+// watch_fd() - Tells an epoll instance to wake us up when a file descriptor becomes readable
+//
+// Passed:  epoll_fd = The epoll instance
+//          fd       = The file descriptor to watch
+//          tag      = What epoll_wait() hands back when the descriptor is readable
+//=================================================================================================
+static void watch_fd(int epoll_fd, int fd, u32 tag)
+{
+    epoll_event event;
+    event.events   = EPOLLIN;
+    event.data.u32 = tag;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// set_tx_high_water() - Sets how many bytes may wait to be sent to a client before we stop
+//                       reading its requests.  Replies to requests already in progress can still
+//                       be queued above this
+//=================================================================================================
+void CServer::set_tx_high_water(int bytes)
+{
+    if (bytes < 1           ) bytes = 1;
+    if (bytes > CONN_TX_SIZE) bytes = CONN_TX_SIZE;
+    m_tx_high_water = bytes;
+}
+//=================================================================================================
+
+
 //=================================================================================================
 // main() - When this thread spawns, execution starts here
 //=================================================================================================
 void CServer::main(void* p1, void* p2, void* p3)
 {
-    fd_set  rfds;
-    char    special_cmd;
+    epoll_event event[SRV_MAX_CONNS * 3 + 2];
+    char        special_cmd;
 
     // Other threads send us messages by writing to this pipe
     pipe(m_special_pipe);
@@ -265,147 +440,332 @@ void CServer::main(void* p1, void* p2, void* p3)
     // Get a convenient name for our side of this pipe
     int special_fd = m_special_pipe[0];
 
-    // Tell the outside world that we are initialized
-    m_is_initialized = true;
-
-wait_for_connect:
-
-    // There is not yet a client connected to our socket
-    m_is_connected = false;
-
-    // Tell the world what's up
-    printf("Waiting for connection on port %i\n", m_tcp_port);
-
-    // Create the server socket
-    if (!m_socket.create_server(m_tcp_port))
+    // We wake up when a command arrives on the pipe, when a client connects, when a message
+    // arrives from a client, when a client can take more of what we're sending it, when an
+    // unsolicited message that a client has subscribed to arrives, or when another thread queues
+    // a message for a client
+    m_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    watch_fd(m_epoll_fd, special_fd, EP_SPECIAL);
+    for (int i=0; i<SRV_MAX_CONNS; ++i)
     {
-        printf("FAILED TO CREATE SERVER ON PORT %i\n", m_tcp_port);
+        watch_fd(m_epoll_fd, m_conn[i].events().get_fd(), EP_EVENTS   | i);
+        watch_fd(m_epoll_fd, m_conn[i].get_tx_fd(),       EP_OUTBOUND | i);
     }
 
-    // Wait for a connection from the outside world
-    if (!m_socket.accept())
+    // Create the server socket and start listening.  It stays open for as long as we run, so a
+    // client that reconnects after we drop it never finds the port closed
+    if (!m_listener.create_server(m_tcp_port) || !m_listener.listen(LISTEN_BACKLOG))
     {
-        printf("FAILED TO ACCEPT CONNECTIONS ON PORT %i\n", m_tcp_port);
+        printf("FAILED TO CREATE SERVER ON PORT %i\n", m_tcp_port);
     }
 
-    // There is now a client connected to our socket
-    m_is_connected = true;
+    // Don't wake us up for a client until it has something to say
+    m_listener.set_defer_accept(DEFER_ACCEPT_SEC);
 
-    // Display a message to the console
-    printf("Client connected to Port %i\n", m_tcp_port);
+    // We only accept when epoll says a client is waiting, and if it gave up in the meantime, we
+    // don't want to block
+    int flags = fcntl(m_listener.get_fd(), F_GETFL, 0);
+    fcntl(m_listener.get_fd(), F_SETFL, flags | O_NONBLOCK);
+    watch_fd(m_epoll_fd, m_listener.get_fd(), EP_LISTENER);
 
-    // Make sure there are no leftover commands waiting in the command pipe
-    drain_fd(special_fd);
+    // Tell the world what's up
+    printf("Waiting for connections on port %i\n", m_tcp_port);
 
-    // Turn off Nagling on the socket so that data is not buffered after we send it
-    m_socket.set_nagling(false);
+    // Tell the outside world that we are initialized
+    m_is_initialized = true;
 
-    // Figure out what the largest file descriptor is
-    int sd = m_socket.get_fd();
-    int max_fd = 0;
-    if (max_fd < sd        ) max_fd = sd;
-    if (max_fd < special_fd) max_fd = special_fd;
+    while (true)
+    {
+        // Wait for something to happen
+        int count = epoll_wait(m_epoll_fd, event, sizeof(event) / sizeof(event[0]), -1);
+        ++m_rx_stats.wakeups;
 
-wait_for_data:
+        // Handle each thing that did
+        for (int i=0; i<count; ++i)
+        {
+            u32          tag  = event[i].data.u32;
+            CConnection& conn = m_conn[tag & EP_INDEX_MASK];
+
+            switch (tag & EP_KIND_MASK)
+            {
+                // If a special command has arrived from another thread...
+                case EP_SPECIAL:
+
+                    // Find out what the command is
+                    read(special_fd, &special_cmd, 1);
+
+                    // If we're being told to forcibly close our connections, do so
+                    if (special_cmd == SPECIAL_CLOSE)
+                    {
+                        for (auto& c : m_conn) if (c.is_open()) close_connection(c, "CHCP_RESET");
+                    }
+                    break;
+
+                // If a client is trying to connect, let it in
+                case EP_LISTENER:
+                    accept_connection();
+                    break;
+
+                // If unsolicited messages are waiting, send them to the client
+                case EP_EVENTS:
+                    if (!conn.is_open()) break;
+                    conn.send_events();
+                    service_connection(conn, false);
+                    break;
+
+                // If another thread queued something for the client, send it
+                case EP_OUTBOUND:
+                    conn.clear_tx_doorbell();
+                    if (conn.is_open()) service_connection(conn, false);
+                    break;
+
+                // If data arrived from a client, read and handle it.  If the client can take more
+                // of what we're sending, send it
+                case EP_SOCKET:
+                    if (!conn.is_open()) break;
+                    service_connection(conn, event[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR));
+                    break;
+            }
+        }
+    }
+}
+//=================================================================================================
 
-    // We want to wake up if any data appears on the socket or on the pipe
-    FD_ZERO(&rfds);
-    FD_SET(sd,         &rfds);
-    FD_SET(special_fd, &rfds);
 
-    // Wait for data to arrive on one of our file descriptors
-    select(max_fd+1, &rfds, NULL, NULL, NULL);
+//=================================================================================================
+// accept_connection() - Accepts every client that's waiting to connect, as long as there's room
+//=================================================================================================
+void CServer::accept_connection()
+{
+    CNetSock socket;
 
-    // If a special command has arrived from another thread...
-    if (FD_ISSET(special_fd, &rfds))
+    // Our listener is non-blocking, so this stops when nobody else is waiting
+    while (m_listener.accept(&socket))
     {
-        // Find out what the command is
-        read(special_fd, &special_cmd, 1);
+        // Find a connection that isn't in use
+        CConnection* conn = nullptr;
+        for (auto& c : m_conn) if (!c.is_open()) {conn = &c; break;}
 
-        // If we're being told to forcibly close the socket connection, do so
-        if (special_cmd == SPECIAL_CLOSE)
+        // If there isn't one, the client is turned away
+        if (conn == nullptr)
         {
-            // Display a message to the console
-            printf("Port %i closed by CHCP_RESET\n", m_tcp_port);
+            printf("Port %i refused a client, %i are already connected\n", m_tcp_port, SRV_MAX_CONNS);
+            socket.close();
+            continue;
+        }
+
+        // Start talking to the client, and wake up when it sends us something
+        int index = conn - m_conn;
+        conn->open(socket);
+        watch_fd(m_epoll_fd, conn->get_fd(), EP_SOCKET | index);
+        m_interest[index] = EPOLLIN;
+
+        // Display a message to the console
+        printf("Client %u connected to Port %i\n", conn->get_id(), m_tcp_port);
+    }
+}
+//=================================================================================================
 
-            // We're no longer connected
-            m_is_connected = false;
 
-            // Close the socket
-            m_socket.close();
+//=================================================================================================
+// service_connection() - Reads whatever has arrived from a client, handles every complete message
+//                        in it, and sends the client whatever is waiting for it
+//
+// Passed:  conn        = The client's connection
+//          is_readable = true if epoll says there's something to read from the socket
+//
+// A host that pipelines its messages gets all of them read with one recv(), no matter how many
+// there are, and all of the replies we queue for it go out together.  Nothing here blocks.
+//
+// If the client isn't keeping up with its replies, epoll watches for its socket to become
+// writable so we can send the rest.  Once more than m_tx_high_water bytes are waiting, we stop
+// handling its requests (even ones we've already read) until it catches up.  If it falls so far
+// behind that a reply is lost, it's disconnected
+//=================================================================================================
+void CServer::service_connection(CConnection& conn, bool is_readable)
+{
+    int index = &conn - m_conn;
+
+    // Read everything that has arrived
+    if (is_readable)
+    {
+        int bytes_read = conn.receive();
+        ++m_rx_stats.reads;
 
-            // And go wait for another connection
-            goto wait_for_connect;
+        // If the client went away, so do we
+        if (bytes_read < 0)
+        {
+            close_connection(conn, "client");
+            return;
         }
+        m_rx_stats.bytes += bytes_read;
     }
 
-    // If data arrived on the socket...
-    if (FD_ISSET(sd, &rfds))
+    m_client = &conn;
+    bool is_caught_up;
+    int  tx_status;
+
+    do
     {
-        // Read in an entire GXIP message from the socket into m_tcp_packet;
-        if (!read_gxip_msg_from_socket())
+        // Handle every complete message we have, unless the client is falling behind.  Until we
+        // find out otherwise, there may be more messages to handle
+        int rx_status = CONN_MSG_COMPLETE;
+        while (conn.tx_backlog() < m_tx_high_water && (rx_status = conn.next_message()) == CONN_MSG_COMPLETE)
         {
-            m_socket.close();
-            printf("Port %i closed by client\n", m_tcp_port);
-            goto wait_for_connect;
+            ++m_rx_stats.messages;
+            dispatch_message();
         }
 
-        // And dispatch this GXIP message to the appropriate handler
-        switch(m_gxip_packet.type)
+        // If the client sent garbage, there's no telling where the next message starts
+        if (rx_status == CONN_MSG_CLOSED)
         {
-            case PRO_PKT:
-                handle_protocol_request();
-                break;
-
-            case CTL_PKT:
-                dispatch_control_request();
-                break;
+            close_connection(conn, "a bad message length");
+            return;
+        }
 
-            case CMD_PKT:
-            case REQ_PKT:
-            case CMD_E_PKT:
-            case REQ_E_PKT:
-                if (m_slot == 0) FWListener.transact(m_gxip_packet);
-                break;
+        // Send the client every reply we've queued, all at once
+        tx_status = conn.flush();
 
-            default:
-                printf("Rcvd msg type %u: ID = 0x%3X\n", m_gxip_packet.type, m_gxip_packet.id());
-                break;
+        // If the socket failed, or the client's queue overflowed, there's no recovering
+        if (tx_status == CONN_TX_FAILED)
+        {
+            if (conn.has_overflowed()) ++m_tx_overflows;
+            close_connection(conn, conn.has_overflowed() ? "falling too far behind" : "a send error");
+            return;
         }
-    }
 
-    // And go back and wait for the next incoming message
-    goto wait_for_data;
+        // If we stopped handling messages only because of the backlog, and that's all been sent,
+        // go handle the rest
+        is_caught_up = (rx_status == CONN_MSG_PARTIAL);
+
+    } while (!is_caught_up && tx_status == CONN_TX_DONE);
 
+    // Decide what we need to hear about from this socket
+    u32 interest = 0;
+    if (tx_status == CONN_TX_BLOCKED       ) interest |= EPOLLOUT;
+    if (conn.tx_backlog() < m_tx_high_water) interest |= EPOLLIN;
+
+    // If that's changed, tell epoll
+    if (interest != m_interest[index])
+    {
+        if (!(interest & EPOLLIN)) ++m_tx_throttled;
+        epoll_event event;
+        event.events   = interest;
+        event.data.u32 = EP_SOCKET | index;
+        epoll_ctl(m_epoll_fd, EPOLL_CTL_MOD, conn.get_fd(), &event);
+        m_interest[index] = interest;
+    }
 }
 //=================================================================================================
 
 
+//=================================================================================================
+// close_connection() - Drops a client
+//
+// Passed:  conn = The client's connection
+//          why  = Who closed it, for the console
+//=================================================================================================
+void CServer::close_connection(CConnection& conn, const char* why)
+{
+    // We no longer care what happens on this socket
+    epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, conn.get_fd(), nullptr);
+
+    // Display a message to the console
+    printf("Client %u on Port %i closed by %s\n", conn.get_id(), m_tcp_port, why);
 
+    // And close it
+    conn.close();
+}
 //=================================================================================================
-// send_gxip_to_host() - Used by other threads to send a GXIP message back to the host
+
+
+//=================================================================================================
+// dispatch_message() - Dispatches the GXIP message from m_client to the appropriate handler
 //=================================================================================================
-PCriticalSection send_gxip_to_host_cs;
-void CServer::send_gxip_to_host(gxip_packet_t& message)
+void CServer::dispatch_message()
 {
-    // Make sure that only one thread at a time tries to do this
-    PSingleLock lock(&send_gxip_to_host_cs);
+    gxip_packet_t& packet = m_client->request();
+
+    switch(packet.type)
+    {
+        case PRO_PKT:
+            handle_protocol_request();
+            break;
+
+        case CTL_PKT:
+            dispatch_control_request();
+            break;
+
+        case CMD_PKT:
+        case REQ_PKT:
+        case CMD_E_PKT:
+        case REQ_E_PKT:
+            // If we have a fresh response to this request, the firmware needn't be bothered
+            if (m_slot == 0 && answer_from_cache()) break;
+
+            // Only the server for slot 0 talks to the firmware.  Anything sent to another
+            // slot never gets there
+            if (m_slot != 0)
+            {
+                com_stats_t::bump(m_com_stats.dropped);
+                break;
+            }
+
+            // If the transaction queue is full, the host gets a "busy" handshake
+            if (!FWListener.transact(packet, m_client->ref())) com_stats_t::bump(m_com_stats.dropped);
+            break;
+
+        default:
+            printf("Rcvd msg type %u: ID = 0x%3X\n", packet.type, packet.id());
+            break;
+    }
+}
+//=================================================================================================
+
 
-    // If there is someone connected to our socket, send the message
-    if (m_is_connected) m_socket.send(&message, message.length());
+//=================================================================================================
+// offer_event() - Called by the FIFO demux to offer us an unsolicited message from the firmware
+//
+// Returns: true if any of our clients has subscribed to this message
+//=================================================================================================
+bool CServer::offer_event(gxip_packet_t& packet)
+{
+    bool is_wanted = false;
+    for (auto& conn : m_conn) if (conn.offer_event(packet)) is_wanted = true;
+    return is_wanted;
 }
 //=================================================================================================
 
 
+//=================================================================================================
+// answer_from_cache() - If the response cache has a fresh response to the client's request,
+//                       sends the host a handshake and that response
+//
+// Returns: true if the request was answered
+//=================================================================================================
+bool CServer::answer_from_cache()
+{
+    // This is the handshake the firmware would have sent
+    static u8 handshake[4] = {0, 4, HSK_PKT, 'A'};
+
+    // If there's no fresh response to this request, the firmware will have to answer it
+    if (!ResponseCache.lookup(m_client->request(), &m_cached_rsp)) return false;
+
+    // Send the host the handshake and the response, just as the firmware would have
+    m_client->send_gxip_to_host(*(gxip_packet_t*)handshake);
+    m_client->send_gxip_to_host(m_cached_rsp);
+    return true;
+}
+//=================================================================================================
 
 
 //=================================================================================================
-// reset_connection() - Sends the server a message that says "Drop your TCP connection"
+// reset_connection() - Sends the server a message that says "Drop your TCP connections"
 //=================================================================================================
 void CServer::reset_connection()
 {
     u8 cmd = SPECIAL_CLOSE;
-    if (m_is_connected) write(m_special_pipe[1], &cmd, 1);
+    if (m_is_initialized) write(m_special_pipe[1], &cmd, 1);
 }
 //=================================================================================================
 
@@ -441,7 +801,7 @@ void CServer::handle_protocol_request()
     packet[4] = PROTOCOL_MINOR;
 
     // Send the packet to the host
-    m_socket.send(packet, sizeof(packet));
+    m_client->send(packet, sizeof(packet));
 }
 //=================================================================================================
 
@@ -465,10 +825,10 @@ void CServer::control_response(void* ptr, int length)
     header.msg_type = RSP_PKT;
 
     // Fill in ID that tells the client what type of msg we're responding to
-    header.msg_id = m_gxip_packet.payload[0];
+    header.msg_id = m_client->request().payload[0];
 
     // Send it back to the client
-    m_socket.send(ptr, length);
+    m_client->send(ptr, length);
 }
 //=================================================================================================
 
@@ -480,7 +840,7 @@ void CServer::control_response(void* ptr, int length)
 void CServer::dispatch_control_request()
 {
     // Find out which control request message is being sent
-    int msg_id = m_gxip_packet.payload[0];
+    int msg_id = m_client->request().payload[0];
 
     switch(msg_id)
     {
@@ -523,6 +883,50 @@ void CServer::dispatch_control_request()
         case CTL_ECHO:
             handle_ctl_echo();
             break;
+
+        case CTL_GET_WAIT_STATS:
+            handle_ctl_get_wait_stats();
+            break;
+
+        case CTL_GET_FIFO_STATS:
+            handle_ctl_get_fifo_stats();
+            break;
+
+        case CTL_GET_LATENCY_STATS:
+            handle_ctl_get_latency_stats();
+            break;
+
+        case CTL_RESET_STATS:
+            handle_ctl_reset_stats();
+            break;
+
+        case CTL_GET_CACHE_STATS:
+            handle_ctl_get_cache_stats();
+            break;
+
+        case CTL_GET_PRIORITY_STATS:
+            handle_ctl_get_priority_stats();
+            break;
+
+        case CTL_SUBSCRIBE:
+            handle_ctl_subscribe(true);
+            break;
+
+        case CTL_UNSUBSCRIBE:
+            handle_ctl_subscribe(false);
+            break;
+
+        case CTL_GET_RX_STATS:
+            handle_ctl_get_rx_stats();
+            break;
+
+        case CTL_GET_TX_STATS:
+            handle_ctl_get_tx_stats();
+            break;
+
+        case CTL_GET_COM_STATS_EXT:
+            handle_ctl_get_com_stats_ext();
+            break;
     }
 }
 //=================================================================================================
@@ -561,15 +965,58 @@ void CServer::handle_ctl_get_dlm_version()
 
 
 //=================================================================================================
-// handle_ctl_get_com_stats() - Responds with the communication statistics
+// handle_ctl_get_com_stats() - Responds with the number of NAK and CAN handshakes that this port
+//                              has received from and sent to its clients
 //
-// Note: Since we aren't supporting this message at this time, just return all zeros
+// Each count is a single byte, and a count of more than 255 is reported as 255.  The full 64-bit
+// counts are in CTL_GET_COM_STATS_EXT
 //=================================================================================================
 void CServer::handle_ctl_get_com_stats()
 {
     ctl_get_com_stats_rsp_t   rsp;
 
-    memset(&rsp, 0, sizeof rsp);
+    // Each count is a single byte, so a count that won't fit is reported as 255
+    auto saturate = [](u64 count) -> u8 {return (count > 255) ? 255 : count;};
+
+    rsp.naks_in  = saturate(m_com_stats.naks_in);
+    rsp.naks_out = saturate(m_com_stats.naks_out);
+    rsp.cans_in  = saturate(m_com_stats.cans_in);
+    rsp.cans_out = saturate(m_com_stats.cans_out);
+
+    control_response(&rsp, sizeof rsp);
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// handle_ctl_get_com_stats_ext() - Responds with the full 64-bit communication statistics, how
+//                                  long this server has been running, and how long it's been since
+//                                  the statistics were cleared
+//=================================================================================================
+void CServer::handle_ctl_get_com_stats_ext()
+{
+    ctl_get_com_stats_ext_rsp_t rsp;
+
+    u64 now = hrclock_usec();
+
+    rsp.uptime_msec    = (now - m_start_usec) / 1000;
+    rsp.stats_age_msec = (now - m_com_stats_usec) / 1000;
+    rsp.bytes_in       = m_com_stats.bytes_in;
+    rsp.bytes_out      = m_com_stats.bytes_out;
+    rsp.naks_in        = m_com_stats.naks_in;
+    rsp.naks_out       = m_com_stats.naks_out;
+    rsp.cans_in        = m_com_stats.cans_in;
+    rsp.cans_out       = m_com_stats.cans_out;
+    rsp.busys_out      = m_com_stats.busys_out;
+    rsp.mrms_out       = m_com_stats.mrms_out;
+    rsp.dropped        = m_com_stats.dropped;
+    rsp.types          = COM_PKT_TYPES;
+
+    for (int i=0; i<COM_PKT_TYPES; ++i)
+    {
+        rsp.msgs_in [i] = m_com_stats.msgs_in [i];
+        rsp.msgs_out[i] = m_com_stats.msgs_out[i];
+    }
 
     control_response(&rsp, sizeof rsp);
 }
@@ -598,7 +1045,7 @@ void CServer::handle_ctl_get_busy_sites()
 {
     ctl_get_busy_sites_rsp_t   rsp;
 
-    rsp.busy_site_map = 0;
+    rsp.busy_site_map = PioMonitor.busy_sites();
 
     control_response(&rsp, sizeof rsp);
 }
@@ -643,7 +1090,7 @@ void CServer::handle_ctl_get_serialnum()
 //=================================================================================================
 void CServer::handle_ctl_set_serialnum()
 {
-    ctl_set_serialnum_req_t& req = *(ctl_set_serialnum_req_t*)&m_gxip_packet;
+    ctl_set_serialnum_req_t& req = *(ctl_set_serialnum_req_t*)&m_client->request();
     ctl_set_serialnum_rsp_t  rsp;
 
     EEPROM.set(SPEC_INSTRUMENT_SN, to_string("%u", req.serialnum));
@@ -664,7 +1111,7 @@ void CServer::handle_ctl_reset()
     const int ASSERT_RESET   = 1;
     const int RELEASE_RESET = 2;
 
-    ctl_reset_req_t& req = *(ctl_reset_req_t*)&m_gxip_packet;
+    ctl_reset_req_t& req = *(ctl_reset_req_t*)&m_client->request();
     ctl_reset_rsp_t  rsp;
 
     // Get a pointer to the PIO that control's the Nios-II's reset line
@@ -685,10 +1132,17 @@ void CServer::handle_ctl_reset()
             usleep(100);
         }
 
+        // The firmware comes out of reset expecting a message header, so a message that's
+        // partially written to the FIFO must never be finished
+        CommFifo.cancel_send();
+
         if (req.flags & RELEASE_RESET)
         {
             reset->data = 0;
         }
+
+        // Whatever the firmware told us before the reset may no longer be true
+        ResponseCache.flush();
     }
 
     // Tell the caller all is well
@@ -706,7 +1160,7 @@ void CServer::handle_ctl_reset()
 void CServer::handle_ctl_echo()
 {
     // Map our response over the original message we received
-    ctl_echo_req_t& rsp = *(ctl_echo_req_t*)&m_gxip_packet;
+    ctl_echo_req_t& rsp = *(ctl_echo_req_t*)&m_client->request();
 
     // And send the client back the message they sent us
     control_response(&rsp, sizeof rsp);
@@ -715,3 +1169,294 @@ void CServer::handle_ctl_echo()
 
 
 
+
+
+//=================================================================================================
+// handle_ctl_get_wait_stats() - Responds with counters that describe how the firmware listener
+//                               has been waiting for messages to arrive from the firmware
+//=================================================================================================
+void CServer::handle_ctl_get_wait_stats()
+{
+    fifo_wait_stats_t         stats;
+    ctl_get_wait_stats_rsp_t  rsp;
+
+    CommFifo.get_wait_stats(&stats);
+
+    rsp.waits            = stats.waits;
+    rsp.spin_hits        = stats.spin_hits;
+    rsp.sleep_hits       = stats.sleep_hits;
+    rsp.irq_hits         = stats.irq_hits;
+    rsp.timeouts         = stats.timeouts;
+    rsp.sleeps           = stats.sleeps;
+    rsp.spin_msec        = stats.spin_usec / 1000;
+    rsp.spin_budget_usec = stats.spin_budget;
+
+    control_response(&rsp, sizeof rsp);
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// copy_fifo_dir_stats() - Copies the telemetry for one direction of the FIFO into a response
+//=================================================================================================
+static void copy_fifo_dir_stats(ctl_fifo_dir_stats_t& out, fifo_dir_stats_t& in)
+{
+    out.words      = in.words;
+    out.messages   = in.messages;
+    out.level      = in.level;
+    out.high_water = in.high_water;
+    out.overflows  = in.overflows;
+    out.underflows = in.underflows;
+    out.wait_msec  = in.wait_usec / 1000;
+    for (int i=0; i<FIFO_FILL_BUCKETS; ++i) out.fill_hist[i] = in.fill_hist[i];
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// handle_ctl_get_fifo_stats() - Responds with throughput and health telemetry for both
+//                               directions of the FIFO to the firmware, and with how many
+//                               handshakes and responses from it matched no transaction
+//=================================================================================================
+void CServer::handle_ctl_get_fifo_stats()
+{
+    fifo_stats_t              stats;
+    fwl_match_stats_t         match;
+    ctl_get_fifo_stats_rsp_t  rsp;
+
+    CommFifo.get_fifo_stats(&stats);
+    FWListener.get_match_stats(&match);
+
+    copy_fifo_dir_stats(rsp.h2f, stats.h2f);
+    copy_fifo_dir_stats(rsp.f2h, stats.f2h);
+    rsp.f2h_resyncs = stats.f2h.resyncs;
+    rsp.stale_hsks  = match.stale_hsks;
+    rsp.stale_rsps  = match.stale_rsps;
+
+    control_response(&rsp, sizeof rsp);
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// handle_ctl_get_latency_stats() - Responds with a summary of how long each phase of a firmware
+//                                  transaction takes, for each message type and ID
+//
+// There can be more (type, ID)s than fit in a response, so the client says which one to start
+// with, and we tell the client how many there are in total
+//=================================================================================================
+void CServer::handle_ctl_get_latency_stats()
+{
+    ctl_get_latency_stats_req_t& req = *(ctl_get_latency_stats_req_t*)&m_client->request();
+    ctl_get_latency_stats_rsp_t  rsp;
+    fwl_latency_summary_t        summary[CTL_LATENCY_ENTRIES];
+    int                          total;
+
+    // If the client didn't say where to start, start at the beginning
+    int first = (m_client->request().length() >= sizeof req) ? (int)req.first : 0;
+
+    // Fetch the summaries
+    int count = FWListener.get_latency_stats(first, summary, CTL_LATENCY_ENTRIES, &total);
+
+    // Fill in the response
+    rsp.total = total;
+    rsp.first = first;
+    rsp.count = count;
+    for (int i=0; i<count; ++i)
+    {
+        rsp.entry[i].msg_type = summary[i].type;
+        rsp.entry[i].msg_id   = summary[i].id;
+        for (int j=0; j<FWL_PHASES; ++j)
+        {
+            rsp.entry[i].phase[j].count    = summary[i].phase[j].count;
+            rsp.entry[i].phase[j].p50_usec = summary[i].phase[j].p50;
+            rsp.entry[i].phase[j].p90_usec = summary[i].phase[j].p90;
+            rsp.entry[i].phase[j].p99_usec = summary[i].phase[j].p99;
+            rsp.entry[i].phase[j].max_usec = summary[i].phase[j].max;
+        }
+    }
+
+    // Send only the entries we filled in
+    control_response(&rsp, offsetof(ctl_get_latency_stats_rsp_t, entry) + count * sizeof(ctl_latency_entry_t));
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// handle_ctl_reset_stats() - Clears the FIFO, wait, latency, cache and priority statistics, and
+//                            this port's receive, send and communication statistics
+//=================================================================================================
+void CServer::handle_ctl_reset_stats()
+{
+    ctl_reset_stats_rsp_t rsp;
+
+    CommFifo.reset_stats();
+    FifoDemux.reset_stats();
+    FWListener.reset_latency_stats();
+    ResponseCache.reset_stats();
+    FWListener.reset_priority_stats();
+    FWListener.reset_match_stats();
+    memset(&m_rx_stats, 0, sizeof m_rx_stats);
+    for (auto& conn : m_conn) conn.reset_tx_stats();
+    m_tx_throttled = 0;
+    m_tx_overflows = 0;
+    m_com_stats.reset();
+    m_com_stats_usec = hrclock_usec();
+
+    rsp.status = 1;
+
+    control_response(&rsp, sizeof rsp);
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// handle_ctl_get_cache_stats() - Responds with how well the response cache is doing
+//=================================================================================================
+void CServer::handle_ctl_get_cache_stats()
+{
+    rsp_cache_stats_t          stats;
+    ctl_get_cache_stats_rsp_t  rsp;
+
+    ResponseCache.get_stats(&stats);
+
+    rsp.hits        = stats.hits;
+    rsp.misses      = stats.misses;
+    rsp.entries     = stats.entries;
+    rsp.bytes_saved = stats.bytes_saved;
+
+    control_response(&rsp, sizeof rsp);
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// handle_ctl_get_priority_stats() - Responds with how deep each priority's queue is, and how long
+//                                   messages wait in it
+//=================================================================================================
+void CServer::handle_ctl_get_priority_stats()
+{
+    fwl_class_stats_t             stats[FWL_PRIORITIES];
+    ctl_get_priority_stats_rsp_t  rsp;
+
+    FWListener.get_priority_stats(stats);
+
+    rsp.count = FWL_PRIORITIES;
+    for (int i=0; i<FWL_PRIORITIES; ++i)
+    {
+        rsp.priority[i].depth         = stats[i].depth;
+        rsp.priority[i].high_water    = stats[i].high_water;
+        rsp.priority[i].queued        = stats[i].queued;
+        rsp.priority[i].rejected      = stats[i].rejected;
+        rsp.priority[i].dispatched    = stats[i].dispatched;
+        rsp.priority[i].max_wait_usec = stats[i].max_wait_usec;
+        rsp.priority[i].wait_usec     = stats[i].wait_usec;
+    }
+
+    control_response(&rsp, sizeof rsp);
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// handle_ctl_subscribe() - Subscribes the client to (or unsubscribes it from) a range of message
+//                          IDs that the firmware sends on its own initiative
+//
+// Passed:  is_subscribe = true for CTL_SUBSCRIBE, false for CTL_UNSUBSCRIBE
+//
+// The response says whether that worked, and how many messages the client has been sent and
+// how many were dropped because the client fell behind
+//=================================================================================================
+void CServer::handle_ctl_subscribe(bool is_subscribe)
+{
+    ctl_subscribe_req_t& req = *(ctl_subscribe_req_t*)&m_client->request();
+    ctl_subscribe_rsp_t  rsp;
+    sub_stats_t          stats;
+
+    // If the client didn't give a range, it means every message ID
+    u16 first = 0, last = 0xFFFF;
+    if (m_client->request().length() >= sizeof req)
+    {
+        first = req.first_id;
+        last  = req.last_id;
+    }
+
+    // Subscribe or unsubscribe
+    if (is_subscribe)
+        rsp.status = m_client->events().subscribe(first, last) ? 1 : 0;
+    else
+    {
+        m_client->events().unsubscribe(first, last);
+        rsp.status = 1;
+    }
+
+    // Tell the client where its subscriptions stand
+    m_client->events().get_stats(&stats);
+    rsp.ranges    = stats.ranges;
+    rsp.forwarded = stats.forwarded;
+    rsp.dropped   = stats.dropped;
+
+    control_response(&rsp, sizeof rsp);
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// handle_ctl_get_rx_stats() - Responds with how many system calls it takes this port to read
+//                             messages from its clients
+//
+// syscalls_per_100_msgs counts the epoll_wait() wakeups and the recv() calls
+//=================================================================================================
+void CServer::handle_ctl_get_rx_stats()
+{
+    ctl_get_rx_stats_rsp_t rsp;
+
+    rsp.wakeups  = m_rx_stats.wakeups;
+    rsp.reads    = m_rx_stats.reads;
+    rsp.bytes    = m_rx_stats.bytes;
+    rsp.messages = m_rx_stats.messages;
+
+    u64 syscalls = m_rx_stats.wakeups + m_rx_stats.reads;
+    rsp.syscalls_per_100_msgs = m_rx_stats.messages ? syscalls * 100 / m_rx_stats.messages : 0;
+
+    control_response(&rsp, sizeof rsp);
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// handle_ctl_get_tx_stats() - Responds with how this port's replies are getting to its clients
+//
+// The counts are summed over every connection, except for high_water, which is the most bytes
+// that have waited to be sent to any one client
+//=================================================================================================
+void CServer::handle_ctl_get_tx_stats()
+{
+    ctl_get_tx_stats_rsp_t rsp;
+    conn_tx_stats_t        stats;
+    u64                    writes = 0, bytes = 0, messages = 0;
+    u32                    blocked = 0, high_water = 0, backlog = 0;
+
+    for (auto& conn : m_conn)
+    {
+        conn.get_tx_stats(&stats);
+        writes   += stats.writes;
+        bytes    += stats.bytes;
+        messages += stats.messages;
+        blocked  += stats.blocked;
+        if (high_water < stats.high_water) high_water = stats.high_water;
+        if (conn.is_open()) backlog += conn.tx_backlog();
+    }
+
+    rsp.writes     = writes;
+    rsp.bytes      = bytes;
+    rsp.messages   = messages;
+    rsp.blocked    = blocked;
+    rsp.high_water = high_water;
+    rsp.backlog    = backlog;
+    rsp.throttled  = m_tx_throttled;
+    rsp.overflows  = m_tx_overflows;
+
+    control_response(&rsp, sizeof rsp);
+}
+//=================================================================================================
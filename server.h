@@ -5,9 +5,30 @@
 #include "cthread.h"
 #include "netsock.h"
 #include "gxip_struct.h"
+#include "connection.h"
 
 //=================================================================================================
-// CServer - Each CServer object manages one TCP connection
+// This is the largest number of hosts that may be connected to one server at the same time
+//=================================================================================================
+#define SRV_MAX_CONNS   4
+//=================================================================================================
+
+
+//=================================================================================================
+// srv_rx_stats_t - Counts of how much work it takes a server to read messages from its clients
+//=================================================================================================
+struct srv_rx_stats_t
+{
+    u64     wakeups;        // Times epoll_wait() woke us up
+    u64     reads;          // Calls to recv()
+    u64     bytes;          // Bytes read from clients
+    u64     messages;       // Complete messages read from clients
+};
+//=================================================================================================
+
+
+//=================================================================================================
+// CServer - Each CServer object listens on one TCP port, and manages every connection to it
 //=================================================================================================
 class CServer : public CThread
 {
@@ -22,19 +43,33 @@ public:
     // Set the slot number (-1 or 0 thru 3) for this server
     void    set_slot(int slot);
 
+    // Sets how many bytes may wait to be sent to a client before we stop reading its requests
+    void    set_tx_high_water(int bytes);
+
     // Call this to find out if the server thread is initialized
     bool    is_initialized() {return m_is_initialized;}
 
-    // Call this to force the server to drop an incoming connection
+    // Call this to force the server to drop every incoming connection
     void    reset_connection();
 
-    // Other threads call this to send a GXIP message back to the host
-    void    send_gxip_to_host(gxip_packet_t& message);
+    // The FIFO demux calls this to offer us an unsolicited message.  Returns true if any of our
+    // clients has subscribed to it
+    bool    offer_event(gxip_packet_t& packet);
 
 protected:
 
-    // This reads a GXIP message from the socket into m_tcp_packet
-    bool          read_gxip_msg_from_socket();
+    // Accepts a new client, if there's room for one
+    void          accept_connection();
+
+    // Reads and handles whatever messages have arrived from a client, and sends it whatever is
+    // waiting for it
+    void          service_connection(CConnection& conn, bool is_readable);
+
+    // Drops a client
+    void          close_connection(CConnection& conn, const char* why);
+
+    // Handles the complete GXIP message in m_client->request()
+    void          dispatch_message();
 
     // Handler for when the client asks what version of the GXIP protocol we're using
     void          handle_protocol_request();
@@ -56,6 +91,19 @@ protected:
     void          handle_ctl_set_serialnum();
     void          handle_ctl_get_serialnum();
     void          handle_ctl_echo();
+    void          handle_ctl_get_wait_stats();
+    void          handle_ctl_get_fifo_stats();
+    void          handle_ctl_get_latency_stats();
+    void          handle_ctl_reset_stats();
+    void          handle_ctl_get_cache_stats();
+    void          handle_ctl_get_priority_stats();
+    void          handle_ctl_subscribe(bool is_subscribe);
+    void          handle_ctl_get_rx_stats();
+    void          handle_ctl_get_tx_stats();
+    void          handle_ctl_get_com_stats_ext();
+
+    // Answers the request in m_client->request() from the response cache, if possible
+    bool          answer_from_cache();
 
     // 0 thru 3
     int           m_slot;
@@ -69,13 +117,36 @@ protected:
     // The main thread will check this after we spawn to see if we're ready to go
     bool          m_is_initialized;
 
-    // This will be true when we think there is a client connected to us
-    bool          m_is_connected;
-
     // This is the server socket that people connect to us on
-    CNetSock      m_socket;
+    CNetSock      m_listener;
+
+    // The epoll instance that watches the listener, the pipe, and every connection
+    int           m_epoll_fd;
+
+    // Our clients, and what epoll is watching for (EPOLLIN and/or EPOLLOUT) on each one's socket
+    CConnection   m_conn[SRV_MAX_CONNS];
+    u32           m_interest[SRV_MAX_CONNS];
+
+    // When this many bytes are waiting to be sent to a client, we stop reading its requests
+    u32           m_tx_high_water;
+
+    // Times we stopped reading from a client because it fell behind, and clients that were
+    // disconnected because they fell too far behind
+    u32           m_tx_throttled, m_tx_overflows;
+
+    // Counts of the traffic to and from all of our clients
+    com_stats_t   m_com_stats;
+
+    // The times (from hrclock_usec) at which we started, and at which m_com_stats was cleared
+    u64           m_start_usec, m_com_stats_usec;
+
+    // The client whose message is being handled
+    CConnection*  m_client;
+
+    // Counts of the system calls it takes to read messages.  Only our own thread touches these
+    srv_rx_stats_t m_rx_stats;
 
-    // This is a message from the socket
-    gxip_packet_t m_gxip_packet;
+    // A response from the response cache, on its way to the host
+    gxip_packet_t m_cached_rsp;
 };
 //=================================================================================================
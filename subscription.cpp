@@ -0,0 +1,159 @@
+//=================================================================================================
+// subscription.cpp - Implements a host's subscription to unsolicited messages from the firmware
+//=================================================================================================
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include "subscription.h"
+
+
+//=================================================================================================
+// Constructor() - Starts out subscribed to nothing, and creates the doorbell
+//=================================================================================================
+CSubscription::CSubscription()
+{
+    m_ranges    = 0;
+    m_forwarded = 0;
+    m_dropped   = 0;
+    m_doorbell  = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// Destructor() - Closes the doorbell
+//=================================================================================================
+CSubscription::~CSubscription()
+{
+    if (m_doorbell != -1) close(m_doorbell);
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// subscribe() - Subscribes to a range of message IDs
+//
+// Returns: false if the range is backwards, or if there's no room for another range
+//=================================================================================================
+bool CSubscription::subscribe(u16 first, u16 last)
+{
+    PSingleLock lock(&m_cs);
+
+    // If the range is backwards, or we're out of room, refuse it
+    if (first > last || m_ranges == SUB_MAX_RANGES) return false;
+
+    // Add the range
+    m_range[m_ranges].first = first;
+    m_range[m_ranges].last  = last;
+    ++m_ranges;
+    return true;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// unsubscribe() - Throws away every subscribed range that lies entirely within first thru last
+//=================================================================================================
+void CSubscription::unsubscribe(u16 first, u16 last)
+{
+    PSingleLock lock(&m_cs);
+
+    // Keep only the ranges that aren't inside first thru last
+    int kept = 0;
+    for (int i=0; i<m_ranges; ++i)
+    {
+        if (m_range[i].first >= first && m_range[i].last <= last) continue;
+        m_range[kept++] = m_range[i];
+    }
+    m_ranges = kept;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// clear() - Throws away every subscription and the counts of messages sent
+//=================================================================================================
+void CSubscription::clear()
+{
+    PSingleLock lock(&m_cs);
+    m_ranges    = 0;
+    m_forwarded = 0;
+    m_dropped   = 0;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// offer() - Queues a copy of an unsolicited message if it's in a subscribed range
+//
+// Returns: true if the message is in a subscribed range, even if it had to be dropped
+//=================================================================================================
+bool CSubscription::offer(gxip_packet_t& packet)
+{
+    uint64_t one = 1;
+    bool     wanted = false;
+
+    // Find out whether the message is in a range we've subscribed to.  We hold the lock until
+    // the message is counted, so that clear() and get_stats() never see a half-counted message
+    m_cs.lock();
+    u16 id = packet.id();
+    for (int i=0; i<m_ranges; ++i)
+    {
+        if (id >= m_range[i].first && id <= m_range[i].last) {wanted = true; break;}
+    }
+
+    // If it isn't, we don't want it
+    if (!wanted)
+    {
+        m_cs.unlock();
+        return false;
+    }
+
+    // If the host has fallen too far behind, this message is dropped
+    gxip_packet_t* slot = m_queue.alloc();
+    if (slot == nullptr)
+    {
+        ++m_dropped;
+        m_cs.unlock();
+        return true;
+    }
+
+    // Queue a copy of the message
+    memcpy(slot, &packet, packet.length());
+    m_queue.publish();
+    ++m_forwarded;
+    m_cs.unlock();
+
+    // And wake up the consumer
+    write(m_doorbell, &one, sizeof one);
+
+    // Tell the caller that we wanted the message
+    return true;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// clear_doorbell() - Clears the doorbell.  Because this is done before the queue is examined, a
+//                    message that arrives afterwards rings it again
+//=================================================================================================
+void CSubscription::clear_doorbell()
+{
+    uint64_t count;
+    read(m_doorbell, &count, sizeof count);
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// get_stats() - Fetches the counts of messages this subscriber has been sent
+//=================================================================================================
+void CSubscription::get_stats(sub_stats_t* p_stats)
+{
+    PSingleLock lock(&m_cs);
+    p_stats->ranges    = m_ranges;
+    p_stats->forwarded = m_forwarded;
+    p_stats->dropped   = m_dropped;
+}
+//=================================================================================================
@@ -0,0 +1,95 @@
+//=================================================================================================
+// subscription.h - Defines a host's subscription to unsolicited messages from the firmware
+//=================================================================================================
+#pragma once
+#include "cthread.h"
+#include "gxip_struct.h"
+#include "spsc_queue.h"
+
+//=================================================================================================
+// This is the largest number of message ID ranges a host may subscribe to
+//=================================================================================================
+#define SUB_MAX_RANGES  8
+//=================================================================================================
+
+
+//=================================================================================================
+// This is the number of messages that may wait to be sent to a subscriber.  If the host falls
+// further behind than this, messages are dropped.  It must be a power of two
+//=================================================================================================
+#define SUB_QUEUE_DEPTH 32
+//=================================================================================================
+
+
+//=================================================================================================
+// sub_stats_t - Counts of the messages a subscriber has been sent
+//=================================================================================================
+struct sub_stats_t
+{
+    u32     ranges;         // The number of ID ranges subscribed to
+    u32     forwarded;      // Messages queued for the host
+    u32     dropped;        // Messages dropped because the host had fallen behind
+};
+//=================================================================================================
+
+
+//=================================================================================================
+// CSubscription - The message ID ranges a host has subscribed to, and a queue of unsolicited
+//                 messages in those ranges that are waiting to be sent to it.
+//
+// The FIFO demux thread is the only producer, so it never blocks waiting for a slow host.  The
+// thread that owns the host's connection is the only consumer.
+//=================================================================================================
+class CSubscription
+{
+public:
+
+    // Constructor
+    CSubscription();
+
+    // Destructor
+    ~CSubscription();
+
+    // Subscribes to (or unsubscribes from) the message IDs "first" thru "last"
+    bool    subscribe(u16 first, u16 last);
+    void    unsubscribe(u16 first, u16 last);
+
+    // Throws away every subscription
+    void    clear();
+
+    // Called by the demux thread.  If the message is in a subscribed range, queues a copy of it
+    // and returns true
+    bool    offer(gxip_packet_t& packet);
+
+    // Returns the doorbell, which is readable whenever a message may be waiting
+    int     get_fd() {return m_doorbell;}
+
+    // Called by the consumer.  Clears the doorbell.  Do this before looking at the queue
+    void    clear_doorbell();
+
+    // Called by the consumer.  Returns the oldest message without removing it, or nullptr
+    gxip_packet_t* peek() {return m_queue.peek();}
+
+    // Called by the consumer.  Removes the message returned by peek()
+    void    discard() {m_queue.discard();}
+
+    // Fetches the counts of messages this subscriber has been sent
+    void    get_stats(sub_stats_t* p_stats);
+
+protected:
+
+    // The subscribed ranges of message IDs, protected by m_cs
+    struct {u16 first, last;} m_range[SUB_MAX_RANGES];
+    int     m_ranges;
+    PCriticalSection m_cs;
+
+    // Messages waiting to be sent to the host
+    CSpscQueue<gxip_packet_t, SUB_QUEUE_DEPTH> m_queue;
+
+    // An eventfd that the producer rings each time it queues a message
+    int     m_doorbell;
+
+    // Counts of the messages this subscriber has been sent, protected by m_cs
+    u32     m_forwarded, m_dropped;
+};
+//=================================================================================================
@@ -0,0 +1,116 @@
+//=================================================================================================
+// uio.cpp - Implements an interface to a Linux UIO (userspace I/O) interrupt line
+//=================================================================================================
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include "uio.h"
+
+
+//=================================================================================================
+// Constructor() - Starts out with no device open
+//=================================================================================================
+CUio::CUio()
+{
+    m_fd = -1;
+    m_is_simulated = false;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// Destructor() - Closes the device
+//=================================================================================================
+CUio::~CUio() {close();}
+//=================================================================================================
+
+
+//=================================================================================================
+// open() - Opens a UIO device
+//
+// Passed:  device = name of a UIO device (i.e., "/dev/uio0") or "sim" for a simulated device
+//
+// Returns: true if the device was opened
+//=================================================================================================
+bool CUio::open(const char* device)
+{
+    // Close any device we may already have open
+    close();
+
+    // Is the caller asking for a simulated device?
+    m_is_simulated = (strcmp(device, "sim") == 0);
+
+    // Simulated devices are backed by an eventfd, real ones by the UIO device driver
+    if (m_is_simulated)
+        m_fd = eventfd(0, EFD_CLOEXEC);
+    else
+        m_fd = ::open(device, O_RDWR | O_CLOEXEC);
+
+    // Tell the caller whether this worked
+    return m_fd != -1;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// close() - Closes the device
+//=================================================================================================
+void CUio::close()
+{
+    if (m_fd != -1) ::close(m_fd);
+    m_fd = -1;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// enable() - Re-enables the interrupt.  The UIO driver masks the interrupt each time it fires
+//=================================================================================================
+void CUio::enable()
+{
+    uint32_t one = 1;
+
+    // Simulated devices don't mask their interrupt, so there's nothing to do
+    if (m_is_simulated) return;
+
+    // Writing a 32-bit '1' to a UIO device unmasks its interrupt
+    write(m_fd, &one, sizeof one);
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// wait() - Waits for an interrupt to arrive
+//
+// Passed:  timeout_ms = the maximum number of milliseconds to wait, or -1 to wait forever
+//
+// Returns: true if an interrupt arrived, false if we timed out
+//=================================================================================================
+bool CUio::wait(int timeout_ms)
+{
+    // A UIO device reports a 32-bit interrupt count, an eventfd reports a 64-bit one
+    uint64_t count;
+    int      count_size = m_is_simulated ? sizeof(uint64_t) : sizeof(uint32_t);
+
+    // Wait for the device to become readable
+    pollfd pfd = {m_fd, POLLIN, 0};
+    if (poll(&pfd, 1, timeout_ms) <= 0) return false;
+
+    // Consume the interrupt count so that the next poll() will block
+    return read(m_fd, &count, count_size) == count_size;
+}
+//=================================================================================================
+
+
+//=================================================================================================
+// raise() - Delivers an interrupt on a simulated device
+//=================================================================================================
+void CUio::raise()
+{
+    uint64_t one = 1;
+    if (m_is_simulated) write(m_fd, &one, sizeof one);
+}
+//=================================================================================================
@@ -0,0 +1,52 @@
+//=================================================================================================
+// uio.h - Defines an interface to a Linux UIO (userspace I/O) interrupt line
+//=================================================================================================
+#pragma once
+
+//=================================================================================================
+// CUio - Waits for interrupts delivered through a /dev/uioX device.
+//
+// For development on x86 (where there is no FPGA), the device can instead be "simulated".  A
+// simulated device is backed by an eventfd, and an interrupt is delivered by calling raise().
+//=================================================================================================
+class CUio
+{
+public:
+
+    // Constructor & destructor
+    CUio();
+    ~CUio();
+
+    // Opens a UIO device by name (i.e., "/dev/uio0"), or a simulated one if the name is "sim"
+    bool    open(const char* device);
+
+    // Closes the device.  Called automatically by the destructor
+    void    close();
+
+    // Returns 'true' if we have an open device
+    bool    is_open() {return m_fd != -1;}
+
+    // Returns 'true' if this is a simulated (eventfd backed) device
+    bool    is_simulated() {return m_is_simulated;}
+
+    // Re-enables delivery of the interrupt.  Must be called before every wait()
+    void    enable();
+
+    // Waits up to timeout_ms milliseconds (-1 = forever) for an interrupt to arrive
+    bool    wait(int timeout_ms);
+
+    // Simulated devices only: delivers an interrupt to whoever is waiting in wait()
+    void    raise();
+
+    // Returns the file descriptor, for callers who want to include it in their own poll()
+    int     get_fd() {return m_fd;}
+
+protected:
+
+    // File descriptor of the UIO device or eventfd
+    int     m_fd;
+
+    // This is true if m_fd is an eventfd rather than a real UIO device
+    bool    m_is_simulated;
+};
+//=================================================================================================